@@ -1,16 +1,244 @@
 #include <iostream>
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <string>
 #include <sstream>
 #include <fstream>
 #include <set>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <climits>
+#include <cstring>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <deque>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <iterator>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BLEND_SSE2 1
+#endif
 
 using namespace std;
 
-const int BOARD_WIDTH = 60;
-const int BOARD_HEIGHT = 40;
-const int BOARDAREA = BOARD_HEIGHT * BOARD_WIDTH;
+// Where command output goes; server threads point it at the client's reply
+thread_local ostream* consoleOutput = &cout;
+
+ostream& console() {
+    return *consoleOutput;
+}
+
+// Scoped trace spans for the hot paths. While tracing is off a span costs one
+// relaxed load; while it is on, each thread appends finished spans to its own
+// ring, overwriting the oldest once the ring wraps.
+atomic<bool> tracing{ false };
+atomic<int64_t> traceStart{ 0 };
+
+int64_t traceClock() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct TraceEvent {
+    const char* name;  // Static string
+    int64_t start, duration;  // Nanoseconds on traceClock
+};
+
+// Written only by its owning thread; trace stop reads it from another one.
+// Each slot is a seqlock: its stamp is zero while the writer fills it and
+// one past the event's position afterwards, so a reader can tell a slot it
+// copied whole from one the writer was overwriting.
+struct TraceRing {
+    static const size_t CAPACITY = 1 << 16;
+
+    struct Slot {
+        atomic<uint64_t> stamp{ 0 };
+        atomic<const char*> name{ nullptr };
+        atomic<int64_t> start{ 0 }, duration{ 0 };
+    };
+
+    unique_ptr<Slot[]> slots;
+    atomic<uint64_t> written{ 0 };
+    int thread;
+
+    explicit TraceRing(int id) : slots(new Slot[CAPACITY]), thread(id) {}
+
+    void push(const TraceEvent& event) {
+        uint64_t n = written.load(memory_order_relaxed);
+        Slot& slot = slots[n % CAPACITY];
+        // Release stores keep the cleared stamp ahead of every new field
+        slot.stamp.store(0, memory_order_relaxed);
+        slot.name.store(event.name, memory_order_release);
+        slot.start.store(event.start, memory_order_release);
+        slot.duration.store(event.duration, memory_order_release);
+        slot.stamp.store(n + 1, memory_order_release);
+        written.store(n + 1, memory_order_release);
+    }
+
+    // False when the slot no longer (or not yet) holds event k
+    bool read(uint64_t k, TraceEvent& event) const {
+        const Slot& slot = slots[k % CAPACITY];
+        if (slot.stamp.load(memory_order_acquire) != k + 1) {
+            return false;
+        }
+        // A field from a newer event makes the stamp read below zero or newer
+        event.name = slot.name.load(memory_order_acquire);
+        event.start = slot.start.load(memory_order_acquire);
+        event.duration = slot.duration.load(memory_order_acquire);
+        return slot.stamp.load(memory_order_relaxed) == k + 1;
+    }
+};
+
+mutex traceRingsLock;
+vector<shared_ptr<TraceRing>> traceRings;  // Kept past thread exit until the next trace start
+
+TraceRing& threadTraceRing() {
+    thread_local shared_ptr<TraceRing> ring;
+    if (!ring) {
+        lock_guard<mutex> lock(traceRingsLock);
+        ring = make_shared<TraceRing>((int)traceRings.size() + 1);
+        traceRings.push_back(ring);
+    }
+    return *ring;
+}
+
+class TraceScope {
+    const char* name;
+    int64_t start;
+
+public:
+    explicit TraceScope(const char* spanName) : name(spanName), start(spanName != nullptr ? traceClock() : 0) {}
+
+    ~TraceScope() {
+        if (name != nullptr) {
+            threadTraceRing().push({ name, start, traceClock() - start });
+        }
+    }
+};
+
+#define TRACE_JOIN2(a, b) a##b
+#define TRACE_JOIN(a, b) TRACE_JOIN2(a, b)
+// The name expression is only evaluated while tracing is on
+#define TRACE_SCOPE(name) TraceScope TRACE_JOIN(traceScope, __LINE__)(tracing.load(memory_order_relaxed) ? (name) : nullptr)
+
+void startTrace() {
+    threadTraceRing();  // Allocated up front so the first span does not pay for it
+    lock_guard<mutex> lock(traceRingsLock);
+    // Rings only the registry still holds belong to threads that have exited
+    traceRings.erase(remove_if(traceRings.begin(), traceRings.end(),
+        [](const shared_ptr<TraceRing>& ring) { return ring.use_count() == 1; }), traceRings.end());
+    traceStart.store(traceClock());
+    tracing.store(true);
+}
+
+// Stops tracing and writes the spans since trace start as Chrome trace-event
+// JSON, which chrome://tracing and Perfetto open directly
+bool stopTrace(const string& filename, size_t& count) {
+    tracing.store(false);
+    int64_t since = traceStart.load();
+    vector<pair<int, TraceEvent>> events;
+    {
+        lock_guard<mutex> lock(traceRingsLock);
+        for (auto& ring : traceRings) {
+            // Spans still closing may overwrite old slots meanwhile; read()
+            // skips those
+            uint64_t end = ring->written.load(memory_order_acquire);
+            uint64_t begin = end > TraceRing::CAPACITY ? end - TraceRing::CAPACITY : 0;
+            TraceEvent event;
+            for (uint64_t k = begin; k < end; ++k) {
+                if (ring->read(k, event) && event.start >= since) {
+                    events.push_back(make_pair(ring->thread, event));
+                }
+            }
+        }
+    }
+    count = events.size();
+    ofstream file(filename);
+    if (!file.is_open()) {
+        return false;
+    }
+    file << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    char line[256];
+    for (size_t k = 0; k < events.size(); ++k) {
+        const TraceEvent& event = events[k].second;
+        snprintf(line, sizeof(line), "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+            k == 0 ? "" : ",", event.name, events[k].first, (event.start - since) / 1000.0, event.duration / 1000.0);
+        file << line;
+    }
+    file << "\n]}\n";
+    return true;
+}
+
+// trace start | trace stop <file>
+void traceCommand(const string& input) {
+    istringstream stream(input);
+    string command, action, filename;
+    stream >> command >> action >> filename;
+    if (action == "start") {
+        startTrace();
+        console() << "Tracing started.\n";
+    }
+    else if (action == "stop" && !filename.empty()) {
+        size_t count = 0;
+        if (!stopTrace(filename, count)) {
+            console() << "Could not open file for the trace.\n";
+            return;
+        }
+        console() << count << " spans written to " << filename << ".\n";
+    }
+    else {
+        console() << "Use: trace start, then trace stop <file>\n";
+    }
+}
+
+// Size of the canvas shapes live on, in cells. --canvas sets it once at
+// startup, before any scene exists; the printed board is a viewport onto it.
+int canvasWidth = 60;
+int canvasHeight = 40;
+const int MAX_CANVAS = 10000;  // Largest canvas side, so cell counts stay in int range
+
+int canvasArea() {
+    return canvasWidth * canvasHeight;
+}
+
+// Parses "<width>x<height>" into the canvas size
+bool setCanvasSize(const string& text) {
+    istringstream stream(text);
+    int width, height;
+    char separator;
+    if (!(stream >> width >> separator >> height) || separator != 'x' || width < 1 || height < 1 ||
+        width > MAX_CANVAS || height > MAX_CANVAS) {
+        return false;
+    }
+    canvasWidth = width;
+    canvasHeight = height;
+    return true;
+}
+
+// Shape kinds as the find command and serialized files name them
+const int TYPE_COUNT = 4;
+const string SHAPE_TYPES[TYPE_COUNT] = { "circle", "rectangle", "triangle", "instance" };
 
 string getColorCode(const string& color) {
     if (color == "red") return "\033[31m";
@@ -22,37 +250,467 @@ string getColorCode(const string& color) {
     else return "";
 }
 
+// Palette slots used by the Braille renderer; slot 0 is the default terminal color
+const int COLOR_COUNT = 7;
+const string COLOR_NAMES[COLOR_COUNT] = { "", "red", "green", "yellow", "blue", "purple", "white" };
+
+int colorIndex(const string& color) {
+    for (int i = 1; i < COLOR_COUNT; ++i) {
+        if (COLOR_NAMES[i] == color) return i;
+    }
+    return 0;
+}
+
+// Palette slot of an escape code produced by getColorCode
+int colorCodeIndex(const string& code) {
+    if (code.size() < 4) return 0;
+    int digit = code[3] - '0';
+    return digit == 7 ? 6 : (digit >= 1 && digit <= 5 ? digit : 0);
+}
+
+// RGB of each palette slot as a typical terminal shows it
+const uint8_t PALETTE_RGB[COLOR_COUNT][3] = {
+    { 229, 229, 229 }, { 205, 0, 0 }, { 0, 205, 0 }, { 205, 205, 0 },
+    { 0, 0, 238 }, { 205, 0, 205 }, { 229, 229, 229 }
+};
+
+int nearestColorIndex(int r, int g, int b) {
+    int best = 1, bestDistance = INT_MAX;
+    for (int i = 1; i < COLOR_COUNT; ++i) {
+        int dr = r - PALETTE_RGB[i][0], dg = g - PALETTE_RGB[i][1], db = b - PALETTE_RGB[i][2];
+        int distance = dr * dr + dg * dg + db * db;
+        if (distance < bestDistance) {
+            bestDistance = distance;
+            best = i;
+        }
+    }
+    return best;
+}
+
+// dst = (src * alpha + dst * (255 - alpha)) / 255, rounded; the SSE2 path
+// handles 16 pixels of one channel per instruction and matches the scalar tail
+void blendChannel(uint8_t* dst, int count, uint8_t src, int alpha) {
+    int i = 0;
+#ifdef BLEND_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i inverse = _mm_set1_epi16((short)(255 - alpha));
+    const __m128i base = _mm_set1_epi16((short)(src * alpha + 128));
+    for (; i + 16 <= count; i += 16) {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(pixels, zero), inverse), base);
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(pixels, zero), inverse), base);
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; i < count; ++i) {
+        int value = dst[i] * (255 - alpha) + src * alpha + 128;
+        dst[i] = (uint8_t)((value + (value >> 8)) >> 8);
+    }
+}
+
+// dst = src + dst * (255 - alpha) / 255, rounded, where src is a premultiplied
+// layer color and alpha varies per pixel; used when compositing layers
+void compositeChannel(uint8_t* dst, const uint8_t* src, const uint8_t* alpha, int count) {
+    int i = 0;
+#ifdef BLEND_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i full = _mm_set1_epi16(255);
+    const __m128i half = _mm_set1_epi16(128);
+    for (; i + 16 <= count; i += 16) {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i a = _mm_loadu_si128((const __m128i*)(alpha + i));
+        __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(pixels, zero), _mm_sub_epi16(full, _mm_unpacklo_epi8(a, zero)));
+        __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(pixels, zero), _mm_sub_epi16(full, _mm_unpackhi_epi8(a, zero)));
+        lo = _mm_add_epi16(lo, half);
+        hi = _mm_add_epi16(hi, half);
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+        __m128i under = _mm_packus_epi16(lo, hi);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_adds_epu8(under, _mm_loadu_si128((const __m128i*)(src + i))));
+    }
+#endif
+    for (; i < count; ++i) {
+        int value = dst[i] * (255 - alpha[i]) + 128;
+        dst[i] = (uint8_t)min(255, src[i] + ((value + (value >> 8)) >> 8));
+    }
+}
+
+// Lookup tables for turning 2x4 dot groups into Braille patterns. rows[r][b]
+// packs the pattern bits contributed by dot row r for four neighbouring cells,
+// where b holds the row's 8 dots (2 per cell), so four cells encode at once.
+struct BrailleTables {
+    uint32_t rows[4][256];
+    unsigned char popcount[256];
+
+    BrailleTables() {
+        const unsigned char leftDot[4] = { 0x01, 0x02, 0x04, 0x40 };
+        const unsigned char rightDot[4] = { 0x08, 0x10, 0x20, 0x80 };
+        for (int r = 0; r < 4; ++r) {
+            for (int b = 0; b < 256; ++b) {
+                uint32_t packed = 0;
+                for (int cell = 0; cell < 4; ++cell) {
+                    uint32_t pattern = 0;
+                    if (b & (1 << (cell * 2))) pattern |= leftDot[r];
+                    if (b & (1 << (cell * 2 + 1))) pattern |= rightDot[r];
+                    packed |= pattern << (cell * 8);
+                }
+                rows[r][b] = packed;
+            }
+        }
+        for (int b = 0; b < 256; ++b) {
+            popcount[b] = (unsigned char)((b & 1) + (b >> 1 & 1) + (b >> 2 & 1) + (b >> 3 & 1) +
+                (b >> 4 & 1) + (b >> 5 & 1) + (b >> 6 & 1) + (b >> 7 & 1));
+        }
+    }
+};
+
+const BrailleTables& brailleTables() {
+    static const BrailleTables tables;
+    return tables;
+}
+
+// Bit-packed sub-cell raster with 2x4 dots per board cell and one bit plane
+// per palette slot. A dot is set in at most one plane, so later shapes win.
+struct DotMask {
+    int width = 0, height = 0;  // In dots
+    int words = 0;              // 64-bit words per dot row
+    vector<uint64_t> planes[COLOR_COUNT];
+
+    void resize(int cellsWide, int cellsHigh) {
+        width = cellsWide * 2;
+        height = cellsHigh * 4;
+        words = (width + 63) / 64;
+        for (auto& plane : planes) {
+            plane.assign((size_t)words * height, 0);
+        }
+    }
+
+    void clear() {
+        for (auto& plane : planes) {
+            fill(plane.begin(), plane.end(), 0);
+        }
+    }
+
+    // Sets dots [from, to] of one row in the color's plane, a word at a time
+    void setSpan(int color, int row, int from, int to) {
+        from = max(from, 0);
+        to = min(to, width - 1);
+        if (row < 0 || row >= height || from > to) {
+            return;
+        }
+        size_t base = (size_t)row * words;
+        for (int w = from / 64; w <= to / 64; ++w) {
+            int lo = max(from, w * 64) - w * 64;
+            int hi = min(to, w * 64 + 63) - w * 64;
+            uint64_t bits = (hi - lo == 63) ? ~0ULL : (((1ULL << (hi - lo + 1)) - 1) << lo);
+            for (int c = 0; c < COLOR_COUNT; ++c) {
+                if (c == color) planes[c][base + w] |= bits;
+                else planes[c][base + w] &= ~bits;
+            }
+        }
+    }
+
+    // Copies a whole row of `source` over dots [at, at + source.width) of a
+    // row here, a source word at a time
+    void copyRow(int color, int row, int at, const DotMask& source, int sourceRow) {
+        const uint64_t* from = &source.planes[color][(size_t)sourceRow * source.words];
+        uint64_t* to = &planes[color][(size_t)row * words];
+        for (int done = 0; done < source.width; done += 64) {
+            int count = min(64, source.width - done);
+            uint64_t mask = count == 64 ? ~0ULL : (1ULL << count) - 1;
+            uint64_t bits = from[done / 64] & mask;
+            int w = (at + done) / 64, shift = (at + done) % 64;
+            to[w] = (to[w] & ~(mask << shift)) | (bits << shift);
+            if (shift != 0 && shift + count > 64) {
+                to[w + 1] = (to[w + 1] & ~(mask >> (64 - shift))) | (bits >> (64 - shift));
+            }
+        }
+    }
+
+    // Dots of four neighbouring cells (8 bits) starting at cell group k
+    unsigned rowByte(int color, int row, int k) const {
+        return (unsigned)(planes[color][(size_t)row * words + k / 8] >> ((k % 8) * 8)) & 0xFF;
+    }
+};
+
+struct Bounds {
+    int left, top, right, bottom;  // Inclusive cell coordinates
+
+    bool intersects(const Bounds& other) const {
+        return left <= other.right && other.left <= right &&
+            top <= other.bottom && other.top <= bottom;
+    }
+};
+
+struct Viewport {
+    int x, y;           // Canvas cell shown in the top-left corner
+    int width, height;  // Size of the printed board
+    int scale;          // Canvas cells folded into one board cell along each axis
+};
+
+const int HOME_VIEW_WIDTH = 60;  // Printed board a session starts with
+const int HOME_VIEW_HEIGHT = 40;
+
+// Top-left corner of the canvas at 1:1, the whole canvas when it fits the
+// default printed board; view reset returns here
+Viewport homeView() {
+    return { 0, 0, min(canvasWidth, HOME_VIEW_WIDTH), min(canvasHeight, HOME_VIEW_HEIGHT), 1 };
+}
+
 struct Board {
+    Viewport view;
     vector<vector<char>> grid;
     vector<vector<string>> colorGrid; // Added colorGrid for storing colors
+    bool braille = false;  // Shapes go into the dot mask and print as Braille characters
+    DotMask dots;
+    vector<uint8_t> rgb[3];   // Accumulated color per cell, one plane per channel
+    vector<uint8_t> blended;  // Cells whose color comes from translucent shapes
+    vector<uint8_t> coverage; // Accumulated opacity per cell, 0 where nothing was drawn
+
+    Board() : Board(homeView()) {}
 
-    Board() : grid(BOARD_HEIGHT, vector<char>(BOARD_WIDTH, ' ')),
-        colorGrid(BOARD_HEIGHT, vector<string>(BOARD_WIDTH, "")) {}
+    explicit Board(const Viewport& v) : view(v) {
+        clear();
+    }
+
+    void setBraille(bool enabled) {
+        braille = enabled;
+        clear();
+    }
+
+    void setViewport(const Viewport& v) {
+        view = v;
+        clear();
+    }
+
+    // Canvas area covered by the viewport, used to cull shapes before rasterizing
+    Bounds visibleArea() const {
+        return { view.x, view.y, view.x + view.width * view.scale - 1, view.y + view.height * view.scale - 1 };
+    }
 
-    void print() {
-        for (int i = 0; i < BOARD_HEIGHT; ++i) {
-            for (int j = 0; j < BOARD_WIDTH; ++j) {
-                if (!colorGrid[i][j].empty()) {
-                    cout << colorGrid[i][j] << grid[i][j] << "\033[0m";
+    void print(ostream& out = console()) {
+        TRACE_SCOPE("Board::print");
+        if (braille) {
+            printBraille(out);
+            return;
+        }
+        for (int i = 0; i < view.height; ++i) {
+            for (int j = 0; j < view.width; ++j) {
+                size_t cell = (size_t)i * view.width + j;
+                if (blended[cell]) {
+                    int slot = nearestColorIndex(rgb[0][cell], rgb[1][cell], rgb[2][cell]);
+                    out << getColorCode(COLOR_NAMES[slot]) << grid[i][j] << "\033[0m";
+                }
+                else if (!colorGrid[i][j].empty()) {
+                    out << colorGrid[i][j] << grid[i][j] << "\033[0m";
                 }
                 else {
-                    cout << grid[i][j];
+                    out << grid[i][j];
+                }
+            }
+            out << "\n";
+        }
+    }
+
+    // Encodes each 2x4 dot group as a Braille code point colored by the plane
+    // covering most of its dots, four cells per table lookup
+    void printBraille(ostream& out) {
+        const BrailleTables& tables = brailleTables();
+        string line;
+        for (int i = 0; i < view.height; ++i) {
+            line.clear();
+            for (int k = 0; k * 4 < view.width; ++k) {
+                uint32_t packed[COLOR_COUNT];
+                uint32_t all = 0;
+                for (int c = 0; c < COLOR_COUNT; ++c) {
+                    packed[c] = 0;
+                    for (int r = 0; r < 4; ++r) {
+                        packed[c] |= tables.rows[r][dots.rowByte(c, i * 4 + r, k)];
+                    }
+                    all |= packed[c];
+                }
+                for (int cell = 0; cell < 4 && k * 4 + cell < view.width; ++cell) {
+                    unsigned pattern = (all >> (cell * 8)) & 0xFF;
+                    if (pattern == 0) {
+                        line += ' ';
+                        continue;
+                    }
+                    int dominant = 0, best = 0;
+                    for (int c = 0; c < COLOR_COUNT; ++c) {
+                        int count = tables.popcount[(packed[c] >> (cell * 8)) & 0xFF];
+                        if (count > best) {
+                            best = count;
+                            dominant = c;
+                        }
+                    }
+                    string colorCode = getColorCode(COLOR_NAMES[dominant]);
+                    line += colorCode;
+                    line += (char)0xE2;
+                    line += (char)(0xA0 | (pattern >> 6));
+                    line += (char)(0x80 | (pattern & 0x3F));
+                    if (!colorCode.empty()) {
+                        line += "\033[0m";
+                    }
                 }
             }
-            cout << "\n";
+            out << line << "\n";
         }
     }
 
+    // Takes canvas coordinates; zoomed-out views downsample by letting the
+    // last canvas cell drawn into a board cell win
     void setPixel(int x, int y, char c, const string& color = "") {
-        if (x >= 0 && x < BOARD_WIDTH && y >= 0 && y < BOARD_HEIGHT) {
+        x -= view.x;
+        y -= view.y;
+        if (x < 0 || y < 0) {
+            return;
+        }
+        if (view.scale > 1) {
+            x /= view.scale;
+            y /= view.scale;
+        }
+        if (x < view.width && y < view.height) {
             grid[y][x] = c;
             colorGrid[y][x] = color;
+            size_t cell = (size_t)y * view.width + x;
+            const uint8_t* shade = PALETTE_RGB[colorCodeIndex(color)];
+            for (int k = 0; k < 3; ++k) {
+                rgb[k][cell] = shade[k];
+            }
+            blended[cell] = 0;
+            coverage[cell] = 255;
+        }
+    }
+
+    // Fills board cells [from, to] of one row; translucent spans blend into
+    // the RGB layer and take their terminal color from it at print time
+    void fillSpan(int row, int from, int to, char c, const string& color, int alpha) {
+        from = max(from, 0);
+        to = min(to, view.width - 1);
+        if (row < 0 || row >= view.height || from > to) {
+            return;
+        }
+        int count = to - from + 1;
+        size_t cell = (size_t)row * view.width + from;
+        const uint8_t* shade = PALETTE_RGB[colorCodeIndex(color)];
+        fill(grid[row].begin() + from, grid[row].begin() + to + 1, c);
+        if (alpha >= 255) {
+            fill(colorGrid[row].begin() + from, colorGrid[row].begin() + to + 1, color);
+            for (int k = 0; k < 3; ++k) {
+                memset(&rgb[k][cell], shade[k], count);
+            }
+            memset(&blended[cell], 0, count);
+            memset(&coverage[cell], 255, count);
+        }
+        else {
+            for (int k = 0; k < 3; ++k) {
+                blendChannel(&rgb[k][cell], count, shade[k], alpha);
+            }
+            memset(&blended[cell], 1, count);
+            blendChannel(&coverage[cell], count, 255, alpha);
+        }
+    }
+
+    // Draws a layer raster of the same view over this board. Untouched cells
+    // are skipped a run at a time, opaque runs replace what is below and
+    // translucent ones blend over it; layer colors start from black, so they
+    // are already premultiplied by the layer's coverage.
+    void composite(const Board& layer) {
+        if (braille) {
+            for (size_t w = 0; w < dots.planes[0].size(); ++w) {
+                uint64_t covered = 0;
+                for (int c = 0; c < COLOR_COUNT; ++c) {
+                    covered |= layer.dots.planes[c][w];
+                }
+                for (int c = 0; c < COLOR_COUNT; ++c) {
+                    dots.planes[c][w] = (dots.planes[c][w] & ~covered) | layer.dots.planes[c][w];
+                }
+            }
+            return;
+        }
+        for (int row = 0; row < view.height; ++row) {
+            size_t start = (size_t)row * view.width;
+            int to = 0;
+            while (true) {
+                int from = to;
+                while (from < view.width && layer.coverage[start + from] == 0) {
+                    ++from;
+                }
+                if (from == view.width) {
+                    break;
+                }
+                to = from;
+                while (to < view.width && layer.coverage[start + to] != 0) {
+                    ++to;
+                }
+                size_t cell = start + from;
+                int count = to - from;
+                copy(layer.grid[row].begin() + from, layer.grid[row].begin() + to, grid[row].begin() + from);
+                for (int k = 0; k < 3; ++k) {
+                    compositeChannel(&rgb[k][cell], &layer.rgb[k][cell], &layer.coverage[cell], count);
+                }
+                compositeChannel(&coverage[cell], &layer.coverage[cell], &layer.coverage[cell], count);
+                for (int j = from; j < to; ++j) {
+                    if (layer.coverage[start + j] == 255) {
+                        colorGrid[row][j] = layer.colorGrid[row][j];
+                    }
+                    blended[start + j] = layer.blended[start + j] || layer.coverage[start + j] < 255;
+                }
+            }
+        }
+    }
+
+    // Copies a board rendered for a cell-aligned part of this view into place,
+    // with the part's top-left cell at (column, row)
+    void paste(const Board& part, int column, int row) {
+        if (braille) {
+            for (int c = 0; c < COLOR_COUNT; ++c) {
+                for (int r = 0; r < part.dots.height; ++r) {
+                    dots.copyRow(c, row * 4 + r, column * 2, part.dots, r);
+                }
+            }
+            return;
         }
+        int count = part.view.width;
+        for (int r = 0; r < part.view.height; ++r) {
+            size_t cell = (size_t)(row + r) * view.width + column, source = (size_t)r * count;
+            copy(part.grid[r].begin(), part.grid[r].end(), grid[row + r].begin() + column);
+            copy(part.colorGrid[r].begin(), part.colorGrid[r].end(), colorGrid[row + r].begin() + column);
+            for (int k = 0; k < 3; ++k) {
+                memcpy(&rgb[k][cell], &part.rgb[k][source], count);
+            }
+            memcpy(&blended[cell], &part.blended[source], count);
+            memcpy(&coverage[cell], &part.coverage[source], count);
+        }
+    }
+
+    // Writes the RGB layer as a binary PPM, one pixel per board cell
+    bool exportImage(const string& filename) const {
+        ofstream file(filename, ios::binary);
+        if (!file.is_open()) {
+            return false;
+        }
+        file << "P6\n" << view.width << " " << view.height << "\n255\n";
+        for (size_t cell = 0; cell < blended.size(); ++cell) {
+            file.put((char)rgb[0][cell]).put((char)rgb[1][cell]).put((char)rgb[2][cell]);
+        }
+        return true;
     }
 
     void clear() {
-        grid.assign(BOARD_HEIGHT, vector<char>(BOARD_WIDTH, ' '));
-        colorGrid.assign(BOARD_HEIGHT, vector<string>(BOARD_WIDTH, ""));
+        TRACE_SCOPE("Board::clear");
+        grid.assign(view.height, vector<char>(view.width, ' '));
+        colorGrid.assign(view.height, vector<string>(view.width, ""));
+        for (auto& plane : rgb) {
+            plane.assign((size_t)view.width * view.height, 0);
+        }
+        blended.assign((size_t)view.width * view.height, 0);
+        coverage.assign((size_t)view.width * view.height, 0);
+        if (braille) {
+            dots.resize(view.width, view.height);
+        }
     }
 };
 
@@ -60,12 +718,21 @@ class Shape {
 protected:
     string color;
     bool isFilled;
+    int opacity;  // Percent, applies to filled shapes
 
 public:
-    Shape() : color("none"), isFilled(false) {}
+    Shape() : color("none"), isFilled(false), opacity(100) {}
+    virtual Shape* clone() const = 0;
     virtual void draw(Board& board) = 0;
     virtual void drawShape(Board& board, string& color) = 0;
     virtual void move(int newX, int newY) = 0;
+    virtual void shift(int dx, int dy) = 0;
+    virtual Bounds bounds() const = 0;
+    // Horizontal extent [left, right) of the shape on canvas row py, where cell
+    // (i, j) covers [i, i + 1) x [j, j + 1); used for sub-cell rendering
+    virtual bool spanAt(double py, double& left, double& right) const = 0;
+    // Cells [from, to] covered by the filled shape on canvas row `row`
+    virtual bool rowSpan(int row, int& from, int& to) const = 0;
     virtual string info() const = 0;
     virtual string serialize() const = 0;
     virtual bool isInsideBoard() const = 0;
@@ -75,10 +742,121 @@ public:
     virtual string getColor() const { return color; }
     virtual void setFilled(bool fill) { isFilled = fill; }
     virtual bool getFilled() const { return isFilled; }
+    virtual void setOpacity(int percent) { opacity = percent; }
+    virtual int getOpacity() const { return opacity; }
     virtual double area() const = 0;
+    virtual int typeIndex() const = 0;  // Slot in SHAPE_TYPES
 
     bool fitsOnBoard() const {
-        return area() <= BOARDAREA;
+        return area() <= canvasArea();
+    }
+
+    // Opacity only shows up in text form for translucent shapes
+    string opacityInfo() const {
+        return opacity < 100 ? ", opacity " + to_string(opacity) + "%" : "";
+    }
+
+    string opacityField() const {
+        return opacity < 100 ? " " + to_string(opacity) : "";
+    }
+
+    // Span-based fill: each board row gets one span covering every canvas row
+    // folded into it, so zoomed-out and translucent shapes blend exactly once
+    virtual void fill(Board& board) const {
+        const Viewport& v = board.view;
+        Bounds b = bounds();
+        Bounds visible = board.visibleArea();
+        int top = max(max(b.top, 0), visible.top);
+        int bottom = min(min(b.bottom, canvasHeight - 1), visible.bottom);
+        int left = max(0, visible.left), right = min(canvasWidth - 1, visible.right);
+        string colorCode = getColorCode(color);
+        int alpha = (opacity * 255 + 50) / 100;
+
+        int boardRow = -1, spanFrom = INT_MAX, spanTo = INT_MIN;
+        for (int row = top; row <= bottom; ++row) {
+            int rowOnBoard = (row - v.y) / v.scale;
+            if (rowOnBoard != boardRow) {
+                if (spanFrom <= spanTo) {
+                    board.fillSpan(boardRow, spanFrom, spanTo, color[0], colorCode, alpha);
+                }
+                boardRow = rowOnBoard;
+                spanFrom = INT_MAX;
+                spanTo = INT_MIN;
+            }
+            int from, to;
+            if (!rowSpan(row, from, to)) {
+                continue;
+            }
+            from = max(from, left);
+            to = min(to, right);
+            if (from <= to) {
+                spanFrom = min(spanFrom, (from - v.x) / v.scale);
+                spanTo = max(spanTo, (to - v.x) / v.scale);
+            }
+        }
+        if (spanFrom <= spanTo) {
+            board.fillSpan(boardRow, spanFrom, spanTo, color[0], colorCode, alpha);
+        }
+    }
+
+    // Rasterizes into the board's dot mask. Frames keep the dots of each row
+    // that are not covered on both neighbouring rows.
+    virtual void drawDots(Board& board) const {
+        const Viewport& v = board.view;
+        const DotMask& mask = board.dots;
+        double dotWidth = v.scale / 2.0, dotHeight = v.scale / 4.0;
+        Bounds b = bounds();
+        int firstRow = max(0, (int)floor((b.top - v.y) / dotHeight) - 1);
+        int lastRow = min(mask.height - 1, (int)ceil((b.bottom + 1 - v.y) / dotHeight));
+        if (firstRow > lastRow) {
+            return;
+        }
+
+        // Canvas limits in dots, matching the clipping of draw/drawShape
+        int canvasLeft = (int)ceil((0 - v.x) / dotWidth - 0.5);
+        int canvasRight = (int)ceil((canvasWidth - v.x) / dotWidth - 0.5) - 1;
+        int plane = isFilled ? colorIndex(color) : 0;
+
+        auto dotSpan = [&](int row, int& from, int& to) {
+            double left, right;
+            if (!spanAt(v.y + (row + 0.5) * dotHeight, left, right)) {
+                return false;
+            }
+            from = (int)ceil((left - v.x) / dotWidth - 0.5);
+            to = (int)ceil((right - v.x) / dotWidth - 0.5) - 1;
+            return from <= to;
+        };
+
+        int prevFrom = 0, prevTo = -1, from = 0, to = -1, nextFrom = 0, nextTo = -1;
+        bool hasPrev = dotSpan(firstRow - 1, prevFrom, prevTo);
+        bool has = dotSpan(firstRow, from, to);
+        for (int row = firstRow; row <= lastRow; ++row) {
+            bool hasNext = dotSpan(row + 1, nextFrom, nextTo);
+            double py = v.y + (row + 0.5) * dotHeight;
+            if (has && py >= 0 && py < canvasHeight) {
+                int l = max(from, canvasLeft), r = min(to, canvasRight);
+                if (isFilled || !hasPrev || !hasNext) {
+                    board.dots.setSpan(plane, row, l, r);
+                }
+                else {
+                    int innerFrom = max(max(prevFrom, from), nextFrom) + 1;
+                    int innerTo = min(min(prevTo, to), nextTo) - 1;
+                    if (innerFrom > innerTo) {
+                        board.dots.setSpan(plane, row, l, r);
+                    }
+                    else {
+                        board.dots.setSpan(plane, row, l, min(r, innerFrom - 1));
+                        board.dots.setSpan(plane, row, max(l, innerTo + 1), r);
+                    }
+                }
+            }
+            hasPrev = has;
+            prevFrom = from;
+            prevTo = to;
+            has = hasNext;
+            from = nextFrom;
+            to = nextTo;
+        }
     }
 
     virtual ~Shape() {}
@@ -90,6 +868,14 @@ class Circle : public Shape {
 public:
     Circle(int centerX, int centerY, int r) : x(centerX), y(centerY), radius(r) {}
 
+    Shape* clone() const override {
+        return new Circle(*this);
+    }
+
+    int typeIndex() const override {
+        return 0;
+    }
+
     double area() const override {
         return 3.14 * radius * radius;
     }
@@ -99,7 +885,7 @@ public:
             for (int j = -radius; j <= radius; ++j) {
                 int distanceSquared = i * i + j * j;
                 if (distanceSquared <= radius * radius && distanceSquared >= (radius - 1) * (radius - 1)) {
-                    if (x + i >= 0 && x + i < BOARD_WIDTH && y + j >= 0 && y + j < BOARD_HEIGHT) {
+                    if (x + i >= 0 && x + i < canvasWidth && y + j >= 0 && y + j < canvasHeight) {
                         board.setPixel(x + i, y + j, '*');
                     }
                 }
@@ -114,7 +900,7 @@ public:
             for (int j = -radius; j <= radius; ++j) {
                 int distanceSquared = i * i + j * j;
                 if (distanceSquared <= radius * radius) {
-                    if (x + i >= 0 && x + i < BOARD_WIDTH && y + j >= 0 && y + j < BOARD_HEIGHT) {
+                    if (x + i >= 0 && x + i < canvasWidth && y + j >= 0 && y + j < canvasHeight) {
                         board.setPixel(x + i, y + j, color[0], colorCode);
                 }
             }
@@ -130,11 +916,45 @@ public:
         y = newY;
     }
 
+    void shift(int dx, int dy) override {
+        x += dx;
+        y += dy;
+    }
+
+    Bounds bounds() const override {
+        return { x - radius, y - radius, x + radius, y + radius };
+    }
+
+    bool spanAt(double py, double& left, double& right) const override {
+        double dy = py - (y + 0.5), outer = radius + 0.5;
+        if (dy <= -outer || dy >= outer) {
+            return false;
+        }
+        double halfWidth = sqrt(outer * outer - dy * dy);
+        left = x + 0.5 - halfWidth;
+        right = x + 0.5 + halfWidth;
+        return true;
+    }
+
+    bool rowSpan(int row, int& from, int& to) const override {
+        int j = row - y;
+        int limit = radius * radius - j * j;
+        if (j < -radius || j > radius || limit < 0) {
+            return false;
+        }
+        int halfWidth = (int)sqrt((double)limit);
+        while ((halfWidth + 1) * (halfWidth + 1) <= limit) ++halfWidth;
+        while (halfWidth * halfWidth > limit) --halfWidth;
+        from = x - halfWidth;
+        to = x + halfWidth;
+        return true;
+    }
+
     bool isValidEdit(const vector<int>& newParams) const override {
         int newRadius = newParams[0];
         return newRadius > 0 &&
-            (x + newRadius < BOARD_WIDTH) &&
-            (y + newRadius < BOARD_HEIGHT);
+            (x + newRadius < canvasWidth) &&
+            (y + newRadius < canvasHeight);
     }
 
     void applyEdit(const vector<int>& newParams) override {
@@ -142,23 +962,23 @@ public:
             radius = newParams[0];
         }
         else {
-            cout << "Invalid parameters for editing Circle. Expected 1 parameter (radius).\n";
+            console() << "Invalid parameters for editing Circle. Expected 1 parameter (radius).\n";
         }
     }
 	
     string info() const override {
         return "Circle: center(" + to_string(x) + ", " + to_string(y) +
             "), radius " + to_string(radius) + ", color " + color +
-            ", " + (isFilled ? "filled" : "frame");
+            ", " + (isFilled ? "filled" : "frame") + opacityInfo();
     }
 
     string serialize() const override {
         return "circle " + to_string(x) + " " + to_string(y) + " " +
-            to_string(radius) + " " + color + " " + (isFilled ? "filled" : "frame");
+            to_string(radius) + " " + color + " " + (isFilled ? "filled" : "frame") + opacityField();
     }
 
     bool isInsideBoard() const override {
-        return (x >= 0 && x < BOARD_WIDTH && y >= 0 && y < BOARD_HEIGHT);
+        return (x >= 0 && x < canvasWidth && y >= 0 && y < canvasHeight);
     }
 };
 
@@ -168,6 +988,14 @@ class Rectangle : public Shape {
 public:
     Rectangle(int left, int top, int w, int h) : x(left), y(top), width(w), height(h) {}
 
+    Shape* clone() const override {
+        return new Rectangle(*this);
+    }
+
+    int typeIndex() const override {
+        return 1;
+    }
+
     double area() const override {
         return width * height;
     }
@@ -176,7 +1004,7 @@ public:
         for (int i = 0; i < height; ++i) {
             for (int j = 0; j < width; ++j) {
                 if ((i == 0 || i == height - 1 || j == 0 || j == width - 1) &&
-                    (x + j >= 0 && x + j < BOARD_WIDTH && y + i >= 0 && y + i < BOARD_HEIGHT)) {
+                    (x + j >= 0 && x + j < canvasWidth && y + i >= 0 && y + i < canvasHeight)) {
                     board.setPixel(x + j, y + i, '*');
                 }
             }
@@ -187,7 +1015,7 @@ public:
         string colorCode = getColorCode(color);
         for (int i = 0; i < height; ++i) {
             for (int j = 0; j < width; ++j) {
-                if (x + j >= 0 && x + j < BOARD_WIDTH && y + i >= 0 && y + i < BOARD_HEIGHT) {
+                if (x + j >= 0 && x + j < canvasWidth && y + i >= 0 && y + i < canvasHeight) {
                     board.setPixel(x + j, y + i, color[0], colorCode);
                 }
             }
@@ -200,13 +1028,40 @@ public:
         y = newY;
     }
 
+    void shift(int dx, int dy) override {
+        x += dx;
+        y += dy;
+    }
+
+    Bounds bounds() const override {
+        return { x, y, x + width - 1, y + height - 1 };
+    }
+
+    bool spanAt(double py, double& left, double& right) const override {
+        if (py < y || py >= y + height) {
+            return false;
+        }
+        left = x;
+        right = x + width;
+        return true;
+    }
+
+    bool rowSpan(int row, int& from, int& to) const override {
+        if (row < y || row >= y + height || width <= 0) {
+            return false;
+        }
+        from = x;
+        to = x + width - 1;
+        return true;
+    }
+
     void applyEdit(const vector<int>& newParams) override {
         if (newParams.size() == 2) {
             width = newParams[0];
             height = newParams[1];
         }
         else {
-            cout << "Invalid parameters for editing Rectangle. Expected 2 parameters (width, height).\n";
+            console() << "Invalid parameters for editing Rectangle. Expected 2 parameters (width, height).\n";
         }
     }
 
@@ -214,22 +1069,22 @@ public:
         int newWidth = newParams[0];
         int newHeight = newParams[1];
         return newWidth > 0 && newHeight > 0 &&
-            (x + newWidth <= BOARD_WIDTH) &&
-            (y + newHeight <= BOARD_HEIGHT);
+            (x + newWidth <= canvasWidth) &&
+            (y + newHeight <= canvasHeight);
     }
 
     string info() const override {
         return "Rectangle (" + to_string(x) + ", " + to_string(y) + "), width: " + to_string(width) + ", height: " + to_string(height) 
-            + ", color " + color + ", " + (isFilled ? "filled" : "frame");
+            + ", color " + color + ", " + (isFilled ? "filled" : "frame") + opacityInfo();
     }
 
     string serialize() const override {
         return "rectangle " + to_string(x) + " " + to_string(y) + " " + to_string(width) + " " + to_string(height) 
-             + color + ", " + (isFilled ? "filled" : "frame");
+             + " " + color + " " + (isFilled ? "filled" : "frame") + opacityField();
     }
 
     bool isInsideBoard() const override {
-        return (x >= 0 && x <= BOARD_WIDTH && y >= 0 && y <= BOARD_HEIGHT);
+        return (x >= 0 && x <= canvasWidth && y >= 0 && y <= canvasHeight);
     }
 };
 
@@ -240,9 +1095,17 @@ class Triangle : public Shape {
 public:
     Triangle(int left, int top, int l, const string& triangleType) : x(left), y(top), length(l), type(triangleType) {}
 
-    double area() const override {
-        if (type == "right") {
-            return 0.5 * length * length; // Area of a right triangle
+    Shape* clone() const override {
+        return new Triangle(*this);
+    }
+
+    int typeIndex() const override {
+        return 2;
+    }
+
+    double area() const override {
+        if (type == "right") {
+            return 0.5 * length * length; // Area of a right triangle
         }
         else if (type == "equal") {
             return (sqrt(3) / 4) * length * length; // Area of an equilateral triangle
@@ -255,7 +1118,7 @@ public:
             for (int i = 0; i < length; ++i) {
                 for (int j = 0; j <= i; ++j) {
                     if (i == length - 1 || j == 0 || j == i) {
-                        if (x + j >= 0 && x + j < BOARD_WIDTH && y + i >= 0 && y + i < BOARD_HEIGHT) {
+                        if (x + j >= 0 && x + j < canvasWidth && y + i >= 0 && y + i < canvasHeight) {
                             board.setPixel(x + j, y + i, '*');
                         }
                     }
@@ -264,16 +1127,16 @@ public:
         }
         else if (type == "equal") {
             for (int i = 0; i < length; ++i) {
-                if (x - i >= 0 && x - i < BOARD_WIDTH && y + i >= 0 && y + i < BOARD_HEIGHT) {
+                if (x - i >= 0 && x - i < canvasWidth && y + i >= 0 && y + i < canvasHeight) {
                     board.setPixel(x - i, y + i, '*');
                 }
-                if (x + i >= 0 && x + i < BOARD_WIDTH && y + i >= 0 && y + i < BOARD_HEIGHT) {
+                if (x + i >= 0 && x + i < canvasWidth && y + i >= 0 && y + i < canvasHeight) {
                     board.setPixel(x + i, y + i, '*');
                 }
             }
 
             for (int j = x - (length - 1); j <= x + (length - 1); ++j) {
-                if (j >= 0 && j < BOARD_WIDTH && y + (length - 1) >= 0 && y + (length - 1) < BOARD_HEIGHT) {
+                if (j >= 0 && j < canvasWidth && y + (length - 1) >= 0 && y + (length - 1) < canvasHeight) {
                     board.setPixel(j, y + (length - 1), '*');
                 }
             }
@@ -285,7 +1148,7 @@ public:
         if (type == "right") {
             for (int i = 0; i < length; ++i) {
                 for (int j = 0; j <= i; ++j) {
-                    if (x + j >= 0 && x + j < BOARD_WIDTH && y + i >= 0 && y + i < BOARD_HEIGHT) {
+                    if (x + j >= 0 && x + j < canvasWidth && y + i >= 0 && y + i < canvasHeight) {
                         board.setPixel(x + j, y + i, color[0], colorCode);
                     }
                 }
@@ -294,7 +1157,7 @@ public:
         else if (type == "equal") {
             for (int i = 0; i < length; ++i) {
                 for (int j = -i; j <= i; ++j) {
-                    if (x + j >= 0 && x + j < BOARD_WIDTH && y + i >= 0 && y + i < BOARD_HEIGHT) {
+                    if (x + j >= 0 && x + j < canvasWidth && y + i >= 0 && y + i < canvasHeight) {
                         board.setPixel(x + j, y + i, color[0], colorCode);
                     }
                 }
@@ -307,268 +1170,2767 @@ public:
         y = newY;
     }
 
+    void shift(int dx, int dy) override {
+        x += dx;
+        y += dy;
+    }
+
+    Bounds bounds() const override {
+        if (type == "equal") {
+            return { x - (length - 1), y, x + (length - 1), y + length - 1 };
+        }
+        return { x, y, x + length - 1, y + length - 1 };
+    }
+
+    bool spanAt(double py, double& left, double& right) const override {
+        double depth = py - y;
+        if (depth < 0 || depth >= length) {
+            return false;
+        }
+        if (type == "equal") {
+            double halfWidth = min(length - 0.5, depth + 0.5);
+            left = x + 0.5 - halfWidth;
+            right = x + 0.5 + halfWidth;
+        }
+        else {
+            left = x;
+            right = x + min((double)length, depth + 1);
+        }
+        return true;
+    }
+
+    bool rowSpan(int row, int& from, int& to) const override {
+        int i = row - y;
+        if (i < 0 || i >= length || (type != "right" && type != "equal")) {
+            return false;
+        }
+        from = type == "equal" ? x - i : x;
+        to = x + i;
+        return true;
+    }
+
     bool isValidEdit(const std::vector<int>& newParams) const override {
         int newLength = newParams[0];
         if (newLength <= 0) {
             return false;
         }
 
-        if (type == "right") {
-            return (x + newLength <= BOARD_WIDTH) && (y + newLength <= BOARD_HEIGHT);
+        if (type == "right") {
+            return (x + newLength <= canvasWidth) && (y + newLength <= canvasHeight);
+        }
+        else if (type == "equal") {
+            return (x - newLength + 1 >= 0) && (x + newLength - 1 < canvasWidth) &&
+                (y + newLength < canvasHeight);
+        }
+
+        return false;
+    }
+
+
+    void applyEdit(const vector<int>& newParams) override {
+        if (newParams.size() == 1) {
+            length = newParams[0];
+        }
+        else {
+            console() << "Invalid parameters for editing Triangle. Expected 1 parameter (length).\n";
+        }
+    }
+
+    string info() const override {
+        return "Triangle (" + to_string(x) + ", " + to_string(y) + "), length: " + to_string(length) + ", type: " + type
+            + ", color " + color + ", " + (isFilled ? "filled" : "frame") + opacityInfo();
+    }
+
+    string serialize() const override {
+        return "triangle " + type + " " + to_string(x) + " " + to_string(y) + " " + to_string(length) 
+            + " " + color + " " + (isFilled ? "filled" : "frame") + opacityField();
+    }
+
+    bool isInsideBoard() const override {
+        return (type == "right" && x >= 0 && x <= canvasWidth && y >= 0 && y <= canvasHeight) ||
+            (type == "equal" && x >= 0 && x < canvasWidth && y >= 0 && y <= canvasHeight);
+    }
+};
+
+// Cells of a symbol on one row with the same glyph and color, relative to the
+// symbol's top-left corner
+struct SymbolRun {
+    int row, from, to;
+    char glyph;
+    string colorCode;
+};
+
+// Group of shapes stored once and drawn by any number of instances. Members
+// stay in serialized form for save files; drawing only uses the runs they
+// rasterized to at 1:1, so instances never touch member geometry.
+struct Symbol {
+    string name;
+    vector<string> members;  // serialize() lines relative to the top-left corner
+    int width, height;
+    vector<SymbolRun> runs;  // By row
+    vector<pair<int, int>> rowExtent;  // First and last covered column per row, from > to when empty
+    int cells;
+
+    // The line save files and the autosave log keep the definition in
+    string definition() const {
+        string line = "symbol " + name;
+        for (size_t k = 0; k < members.size(); ++k) {
+            line += (k == 0 ? " " : "; ") + members[k];
+        }
+        return line;
+    }
+};
+
+typedef map<string, shared_ptr<const Symbol>> SymbolTable;
+
+// One placement of a symbol: an offset and an optional color that replaces
+// the members' own colors. "none" keeps them.
+class Instance : public Shape {
+    shared_ptr<const Symbol> symbol;
+    int x, y;
+
+    // Run glyph and color with the override applied; frames keep their '*'
+    char glyph(const SymbolRun& run) const {
+        return color == "none" || run.glyph == '*' ? run.glyph : color[0];
+    }
+
+    string colorCode(const SymbolRun& run) const {
+        return color == "none" ? run.colorCode : getColorCode(color);
+    }
+
+    // Plots every cell of the runs one at a time; the reference for fill
+    void plotRuns(Board& board) const {
+        for (const SymbolRun& run : symbol->runs) {
+            int row = y + run.row;
+            int from = max(x + run.from, 0), to = min(x + run.to, canvasWidth - 1);
+            if (row < 0 || row >= canvasHeight) {
+                continue;
+            }
+            for (int column = from; column <= to; ++column) {
+                board.setPixel(column, row, glyph(run), colorCode(run));
+            }
+        }
+    }
+
+public:
+    Instance(shared_ptr<const Symbol> s, int left, int top) : symbol(s), x(left), y(top) {}
+
+    Shape* clone() const override {
+        return new Instance(*this);
+    }
+
+    int typeIndex() const override {
+        return 3;
+    }
+
+    double area() const override {
+        return symbol->cells;
+    }
+
+    // Runs are solid, so instances always take the fill paths
+    bool getFilled() const override {
+        return true;
+    }
+
+    void draw(Board& board) override {
+        plotRuns(board);
+    }
+
+    void drawShape(Board& board, string&) override {
+        plotRuns(board);
+    }
+
+    // Whole runs at 1:1; zoomed out they fold into cells pixel by pixel
+    void fill(Board& board) const override {
+        const Viewport& v = board.view;
+        if (v.scale > 1) {
+            plotRuns(board);
+            return;
+        }
+        for (const SymbolRun& run : symbol->runs) {
+            int row = y + run.row;
+            int from = max(x + run.from, 0), to = min(x + run.to, canvasWidth - 1);
+            if (row < 0 || row >= canvasHeight || from > to) {
+                continue;
+            }
+            board.fillSpan(row - v.y, from - v.x, to - v.x, glyph(run), colorCode(run), 255);
+        }
+    }
+
+    // Each run covers the dots whose centers fall inside its cells
+    void drawDots(Board& board) const override {
+        const Viewport& v = board.view;
+        double dotWidth = v.scale / 2.0, dotHeight = v.scale / 4.0;
+        for (const SymbolRun& run : symbol->runs) {
+            int row = y + run.row;
+            int from = max(x + run.from, 0), to = min(x + run.to, canvasWidth - 1);
+            if (row < 0 || row >= canvasHeight || from > to) {
+                continue;
+            }
+            int plane = colorCodeIndex(colorCode(run));
+            int dotFrom = (int)ceil((from - v.x) / dotWidth - 0.5);
+            int dotTo = (int)ceil((to + 1 - v.x) / dotWidth - 0.5) - 1;
+            int lastDotRow = (int)ceil((row + 1 - v.y) / dotHeight - 0.5) - 1;
+            for (int dotRow = (int)ceil((row - v.y) / dotHeight - 0.5); dotRow <= lastDotRow; ++dotRow) {
+                board.dots.setSpan(plane, dotRow, dotFrom, dotTo);
+            }
+        }
+    }
+
+    void move(int newX, int newY) override {
+        x = newX;
+        y = newY;
+    }
+
+    void shift(int dx, int dy) override {
+        x += dx;
+        y += dy;
+    }
+
+    Bounds bounds() const override {
+        return { x, y, x + symbol->width - 1, y + symbol->height - 1 };
+    }
+
+    bool spanAt(double py, double& left, double& right) const override {
+        int from, to;
+        if (!rowSpan((int)floor(py), from, to)) {
+            return false;
+        }
+        left = from;
+        right = to + 1;
+        return true;
+    }
+
+    bool rowSpan(int row, int& from, int& to) const override {
+        if (row < y || row >= y + symbol->height) {
+            return false;
+        }
+        from = x + symbol->rowExtent[row - y].first;
+        to = x + symbol->rowExtent[row - y].second;
+        return from <= to;
+    }
+
+    string info() const override {
+        return "Instance of " + symbol->name + " at (" + to_string(x) + ", " + to_string(y) + "), " +
+            (color == "none" ? string("symbol colors") : "color " + color);
+    }
+
+    string serialize() const override {
+        return "instance " + symbol->name + " " + to_string(x) + " " + to_string(y) + " " + color;
+    }
+
+    bool isInsideBoard() const override {
+        return x >= 0 && x < canvasWidth && y >= 0 && y < canvasHeight;
+    }
+
+    // Instances are moved or repainted, never resized
+    bool isValidEdit(const vector<int>&) const override {
+        return false;
+    }
+
+    void applyEdit(const vector<int>&) override {}
+};
+
+// Builds a shape from a serialize() line; nullptr when the line is not a
+// shape. Instance lines resolve their symbol in `symbols`.
+Shape* parseShape(const string& line, const SymbolTable& symbols = SymbolTable()) {
+    istringstream lineStream(line);
+    string shapeType;
+    lineStream >> shapeType;
+
+    Shape* shape = nullptr;
+    if (shapeType == "circle") {
+        int x, y, radius;
+        if (lineStream >> x >> y >> radius) {
+            shape = new Circle(x, y, radius);
+        }
+    }
+    else if (shapeType == "rectangle") {
+        int x, y, width, height;
+        if (lineStream >> x >> y >> width >> height) {
+            shape = new Rectangle(x, y, width, height);
+        }
+    }
+    else if (shapeType == "triangle") {
+        string triangleType;
+        int x, y, length;
+        if (lineStream >> triangleType >> x >> y >> length) {
+            shape = new Triangle(x, y, length, triangleType);
+        }
+    }
+    else if (shapeType == "instance") {
+        string name;
+        int x, y;
+        if (lineStream >> name >> x >> y && symbols.count(name)) {
+            shape = new Instance(symbols.at(name), x, y);
+        }
+    }
+    if (shape == nullptr) {
+        return nullptr;
+    }
+
+    string color, fillStatus;
+    int opacity;
+    if (lineStream >> color) {
+        shape->setColor(color);
+    }
+    lineStream >> fillStatus;
+    shape->setFilled(fillStatus == "filled" || fillStatus == "fill");
+    if (lineStream >> opacity) {
+        shape->setOpacity(opacity);
+    }
+    return shape;
+}
+
+// The original per-pixel rasterizer: draw/drawShape plot every covered cell
+// through setPixel. Kept as the reference the faster paths are checked against.
+void renderReference(Shape* shape, Board& board) {
+    TRACE_SCOPE(SHAPE_TYPES[shape->typeIndex()].c_str());
+    if (shape->getFilled() == true) {
+        string color = shape->getColor();
+        shape->drawShape(board, color);
+    }
+    else {
+        shape->draw(board);
+    }
+}
+
+void renderShape(Shape* shape, Board& board) {
+    TRACE_SCOPE(SHAPE_TYPES[shape->typeIndex()].c_str());
+    if (board.braille) {
+        shape->drawDots(board);
+    }
+    else if (shape->getFilled() == true) {
+        shape->fill(board);
+    }
+    else {
+        shape->draw(board);
+    }
+}
+
+// Rasterizes members given relative to (0, 0) into a symbol's runs; nullptr
+// when a member does not parse
+shared_ptr<const Symbol> buildSymbol(const string& name, const vector<string>& members, const SymbolTable& symbols) {
+    vector<unique_ptr<Shape>> shapes;
+    int width = 1, height = 1;
+    for (const string& member : members) {
+        Shape* shape = parseShape(member, symbols);
+        if (shape == nullptr) {
+            return nullptr;
+        }
+        shapes.emplace_back(shape);
+        Bounds b = shape->bounds();
+        width = max(width, min(b.right + 1, canvasWidth));
+        height = max(height, min(b.bottom + 1, canvasHeight));
+    }
+
+    Board scratch({ 0, 0, width, height, 1 });
+    for (auto& shape : shapes) {
+        renderShape(shape.get(), scratch);
+    }
+    shared_ptr<Symbol> symbol = make_shared<Symbol>();
+    symbol->name = name;
+    symbol->members = members;
+    symbol->width = width;
+    symbol->height = height;
+    symbol->rowExtent.assign(height, make_pair(INT_MAX, INT_MIN));
+    symbol->cells = 0;
+    for (int row = 0; row < height; ++row) {
+        for (int column = 0; column < width; ++column) {
+            char glyph = scratch.grid[row][column];
+            if (glyph == ' ') {
+                continue;
+            }
+            // Translucent cells are frozen to the palette color they print as
+            size_t cell = (size_t)row * width + column;
+            string colorCode = scratch.blended[cell] ? getColorCode(COLOR_NAMES[nearestColorIndex(
+                scratch.rgb[0][cell], scratch.rgb[1][cell], scratch.rgb[2][cell])]) : scratch.colorGrid[row][column];
+            vector<SymbolRun>& runs = symbol->runs;
+            if (!runs.empty() && runs.back().row == row && runs.back().to == column - 1 &&
+                runs.back().glyph == glyph && runs.back().colorCode == colorCode) {
+                runs.back().to = column;
+            }
+            else {
+                runs.push_back({ row, column, column, glyph, colorCode });
+            }
+            symbol->rowExtent[row].first = min(symbol->rowExtent[row].first, column);
+            symbol->rowExtent[row].second = column;
+            ++symbol->cells;
+        }
+    }
+    return symbol;
+}
+
+// Reads a "symbol <name> <member>; <member>; ..." definition line
+shared_ptr<const Symbol> parseSymbol(const string& line, const SymbolTable& symbols) {
+    istringstream stream(line);
+    string keyword, name, member;
+    stream >> keyword >> name;
+    vector<string> members;
+    while (getline(stream >> ws, member, ';')) {
+        members.push_back(member);
+    }
+    if (keyword != "symbol" || name.empty() || members.empty()) {
+        return nullptr;
+    }
+    return buildSymbol(name, members, symbols);
+}
+
+// Ordered int-keyed map whose versions share structure: a treap with path
+// copying, so copying the map is O(1) and every update copies O(log n) nodes.
+// Priorities are a hash of the key, so a key set always has the same tree
+// shape and diff() skips every subtree two versions still share.
+template <typename V>
+class PersistentMap {
+    struct Node;
+    typedef shared_ptr<const Node> Link;
+
+    struct Node {
+        pair<const int, V> entry;
+        Link left, right;
+        size_t size;
+
+        Node(const pair<const int, V>& e, const Link& l, const Link& r) : entry(e), left(l), right(r),
+            size(1 + (l ? l->size : 0) + (r ? r->size : 0)) {}
+    };
+
+    Link root;
+
+    static uint32_t priority(int key) {
+        uint32_t h = (uint32_t)key * 0x9E3779B1u;
+        h ^= h >> 15;
+        h *= 0x85EBCA77u;
+        return h ^ (h >> 13);
+    }
+
+    // Whether key a sits above key b in the treap
+    static bool outranks(int a, int b) {
+        uint32_t pa = priority(a), pb = priority(b);
+        return pa != pb ? pa > pb : a < b;
+    }
+
+    static Link make(const pair<const int, V>& entry, const Link& left, const Link& right) {
+        return make_shared<const Node>(entry, left, right);
+    }
+
+    // Splits around a key that is not in the tree
+    static void split(const Link& t, int key, Link& less, Link& greater) {
+        if (!t) {
+            less = greater = nullptr;
+        }
+        else if (t->entry.first < key) {
+            Link middle;
+            split(t->right, key, middle, greater);
+            less = make(t->entry, t->left, middle);
+        }
+        else {
+            Link middle;
+            split(t->left, key, less, middle);
+            greater = make(t->entry, middle, t->right);
+        }
+    }
+
+    static Link merge(const Link& a, const Link& b) {
+        if (!a || !b) {
+            return a ? a : b;
+        }
+        if (outranks(a->entry.first, b->entry.first)) {
+            return make(a->entry, a->left, merge(a->right, b));
+        }
+        return make(b->entry, merge(a, b->left), b->right);
+    }
+
+    static Link insert(const Link& t, const pair<const int, V>& entry) {
+        int key = entry.first;
+        if (t && t->entry.first == key) {
+            return make(entry, t->left, t->right);
+        }
+        if (!t || outranks(key, t->entry.first)) {
+            Link less, greater;
+            split(t, key, less, greater);
+            return make(entry, less, greater);
+        }
+        if (key < t->entry.first) {
+            return make(t->entry, insert(t->left, entry), t->right);
+        }
+        return make(t->entry, t->left, insert(t->right, entry));
+    }
+
+    static Link erase(const Link& t, int key) {
+        if (!t) {
+            return t;
+        }
+        if (t->entry.first == key) {
+            return merge(t->left, t->right);
+        }
+        if (key < t->entry.first) {
+            Link left = erase(t->left, key);
+            return left == t->left ? t : make(t->entry, left, t->right);
+        }
+        Link right = erase(t->right, key);
+        return right == t->right ? t : make(t->entry, t->left, right);
+    }
+
+    // Value stored under key, or nullptr; unlike find() it allocates nothing
+    const V* lookup(int key) const {
+        for (const Node* node = root.get(); node != nullptr;) {
+            if (key < node->entry.first) {
+                node = node->left.get();
+            }
+            else if (key > node->entry.first) {
+                node = node->right.get();
+            }
+            else {
+                return &node->entry.second;
+            }
+        }
+        return nullptr;
+    }
+
+    template <typename F>
+    static void each(const Link& t, bool inBefore, F& report) {
+        if (t) {
+            each(t->left, inBefore, report);
+            report(t->entry.first, inBefore ? &t->entry.second : nullptr, inBefore ? nullptr : &t->entry.second);
+            each(t->right, inBefore, report);
+        }
+    }
+
+    template <typename F>
+    static void diff(const Link& a, const Link& b, F& report) {
+        if (a == b) {
+            return;
+        }
+        if (!a || !b) {
+            each(a ? a : b, (bool)a, report);
+            return;
+        }
+        int ka = a->entry.first, kb = b->entry.first;
+        if (ka == kb) {
+            diff(a->left, b->left, report);
+            if (!(a->entry.second == b->entry.second)) {
+                report(ka, &a->entry.second, &b->entry.second);
+            }
+            diff(a->right, b->right, report);
+        }
+        else if (outranks(ka, kb)) {
+            // The higher-ranked root key would be b's root too if b had it
+            Link less, greater;
+            split(b, ka, less, greater);
+            diff(a->left, less, report);
+            report(ka, &a->entry.second, nullptr);
+            diff(a->right, greater, report);
+        }
+        else {
+            Link less, greater;
+            split(a, kb, less, greater);
+            diff(less, b->left, report);
+            report(kb, nullptr, &b->entry.second);
+            diff(greater, b->right, report);
+        }
+    }
+
+public:
+    class const_iterator {
+        vector<const Node*> path;  // Ancestors still to visit; the top is the current node
+
+        void descend(const Node* node) {
+            for (; node != nullptr; node = node->left.get()) {
+                path.push_back(node);
+            }
+        }
+
+        friend class PersistentMap;
+
+    public:
+        typedef forward_iterator_tag iterator_category;
+        typedef pair<const int, V> value_type;
+        typedef ptrdiff_t difference_type;
+        typedef const value_type* pointer;
+        typedef const value_type& reference;
+
+        reference operator*() const {
+            return path.back()->entry;
+        }
+
+        pointer operator->() const {
+            return &path.back()->entry;
+        }
+
+        const_iterator& operator++() {
+            const Node* node = path.back();
+            path.pop_back();
+            descend(node->right.get());
+            return *this;
+        }
+
+        bool operator==(const const_iterator& other) const {
+            return (path.empty() ? nullptr : path.back()) == (other.path.empty() ? nullptr : other.path.back());
+        }
+
+        bool operator!=(const const_iterator& other) const {
+            return !(*this == other);
+        }
+    };
+
+    const_iterator begin() const {
+        const_iterator it;
+        it.descend(root.get());
+        return it;
+    }
+
+    const_iterator end() const {
+        return const_iterator();
+    }
+
+    const_iterator find(int key) const {
+        const_iterator it;
+        for (const Node* node = root.get(); node != nullptr;) {
+            if (key < node->entry.first) {
+                it.path.push_back(node);
+                node = node->left.get();
+            }
+            else if (key > node->entry.first) {
+                node = node->right.get();
+            }
+            else {
+                it.path.push_back(node);
+                return it;
+            }
+        }
+        return end();
+    }
+
+    const V& at(int key) const {
+        const V* value = lookup(key);
+        if (value == nullptr) {
+            throw out_of_range("PersistentMap::at");
+        }
+        return *value;
+    }
+
+    size_t count(int key) const {
+        return lookup(key) != nullptr ? 1 : 0;
+    }
+
+    // Entry with the largest key; the map must not be empty
+    const pair<const int, V>& back() const {
+        const Node* node = root.get();
+        while (node->right) {
+            node = node->right.get();
+        }
+        return node->entry;
+    }
+
+    size_t size() const {
+        return root ? root->size : 0;
+    }
+
+    bool empty() const {
+        return !root;
+    }
+
+    void set(int key, const V& value) {
+        root = insert(root, pair<const int, V>(key, value));
+    }
+
+    void erase(int key) {
+        root = erase(root, key);
+    }
+
+    void clear() {
+        root.reset();
+    }
+
+    // Calls report(key, before, after) in key order for every key whose value
+    // differs; before or after is nullptr where that version lacks the key
+    template <typename F>
+    void diff(const PersistentMap& other, F report) const {
+        diff(root, other.root, report);
+    }
+};
+
+// Immutable picture of the scene handed to the render thread. The maps share
+// their nodes with the scene, so publishing one costs the same for any scene
+// size; the render thread works out the drawing order itself.
+struct Frame {
+    PersistentMap<shared_ptr<Shape>> shapes;
+    PersistentMap<string> shapeLayers;  // Same ids as shapes
+    vector<string> layers;  // Visible layers, bottom first
+    Viewport view;
+    bool braille;
+};
+
+void renderFrame(const Frame& frame, Board& board) {
+    board.braille = frame.braille;
+    board.setViewport(frame.view);
+    Bounds visible = board.visibleArea();
+    // One pass over both maps culls the shapes and sorts them into their layers
+    vector<vector<Shape*>> drawn(frame.layers.size());
+    auto layer = frame.shapeLayers.begin();
+    for (auto& entry : frame.shapes) {
+        while (layer != frame.shapeLayers.end() && layer->first < entry.first) {
+            ++layer;
+        }
+        if (layer == frame.shapeLayers.end() || layer->first != entry.first ||
+            !entry.second->bounds().intersects(visible)) {
+            continue;
+        }
+        size_t k = std::find(frame.layers.begin(), frame.layers.end(), layer->second) - frame.layers.begin();
+        if (k < drawn.size()) {
+            drawn[k].push_back(entry.second.get());
+        }
+    }
+    for (auto& shapes : drawn) {
+        for (Shape* shape : shapes) {
+            renderShape(shape, board);
+        }
+    }
+}
+
+// Lock-free ring for one producer thread and one consumer thread
+template <typename T, size_t Capacity>
+class SpscQueue {
+    T slots[Capacity];
+    atomic<size_t> head{ 0 };  // Next slot to pop, owned by the consumer
+    atomic<size_t> tail{ 0 };  // Next slot to push, owned by the producer
+
+public:
+    bool push(const T& item) {
+        size_t t = tail.load(memory_order_relaxed);
+        if (t - head.load(memory_order_acquire) == Capacity) {
+            return false;
+        }
+        slots[t % Capacity] = item;
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+
+    bool pop(T& item) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire)) {
+            return false;
+        }
+        item = move(slots[h % Capacity]);
+        slots[h % Capacity] = T();
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return head.load(memory_order_acquire) == tail.load(memory_order_acquire);
+    }
+};
+
+// Renders and prints frames on its own thread so a slow redraw never holds up
+// the next command. Frames queued while a render is running are skipped and
+// only the newest one is drawn.
+class AsyncRenderer {
+    SpscQueue<shared_ptr<const Frame>, 256> frames;
+    atomic<bool> stopping{ false };
+    mutex wakeMutex;  // Only used to sleep while the queue is empty
+    condition_variable wake;
+    Board board;
+    thread worker;
+
+    void run() {
+        while (true) {
+            shared_ptr<const Frame> latest, next;
+            while (frames.pop(next)) {
+                latest = next;
+            }
+            if (latest) {
+                renderFrame(*latest, board);
+                ostringstream text;
+                board.print(text);
+                cout << text.str() << flush;
+                continue;
+            }
+            if (stopping.load()) {
+                return;
+            }
+            unique_lock<mutex> lock(wakeMutex);
+            wake.wait_for(lock, chrono::milliseconds(20), [this] { return stopping.load() || !frames.empty(); });
+        }
+    }
+
+public:
+    AsyncRenderer() : worker(&AsyncRenderer::run, this) {}
+
+    ~AsyncRenderer() {
+        stopping.store(true);
+        wake.notify_one();
+        worker.join();
+    }
+
+    void publish(shared_ptr<const Frame> frame) {
+        while (!frames.push(frame)) {
+            this_thread::yield();
+        }
+        wake.notify_one();
+    }
+};
+
+const size_t LOG_COMPACT_BYTES = 256 * 1024;  // Log size that triggers a new snapshot
+
+// Crash-safe autosave: every mutation is appended to a log as a state record
+// ("a"/"u" <id> <shape>, "r" <id>, "l" <id> <layer>, a symbol definition
+// line, or the layer stack as "layers ..." and "active <layer>"), records are
+// written out and synced to disk once per command, and a background thread
+// folds the log into a full snapshot once it grows past LOG_COMPACT_BYTES.
+// The snapshot uses the same records after a "next <id>" line, the symbol
+// definitions and the layer stack, so recovery simply replays snapshot and
+// logs in order. Files are synced before any rename or remove that depends
+// on them, so a power loss cannot leave an empty snapshot behind.
+class OperationLog {
+    string snapshotPath, logPath, frozenPath;
+    ofstream log;
+    string pending;
+    size_t logBytes = 0;
+    thread compactor;
+    atomic<bool> compacting{ false };
+
+    // Forces a file's contents to disk; on POSIX a directory path syncs its
+    // entries, so completed renames and removes survive a power loss too
+    static bool sync(const string& path) {
+#ifndef _WIN32
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        bool synced = fsync(fd) == 0;
+        ::close(fd);
+        return synced;
+#else
+        // NTFS journals directory entries itself; only file data needs a commit
+        int fd = _open(path.c_str(), _O_WRONLY);
+        if (fd < 0) {
+            return true;
+        }
+        bool synced = _commit(fd) == 0;
+        _close(fd);
+        return synced;
+#endif
+    }
+
+    static string directoryOf(const string& path) {
+        size_t slash = path.find_last_of("/\\");
+        return slash == string::npos ? "." : path.substr(0, slash + 1);
+    }
+
+    static bool replace(const string& from, const string& to) {
+        if (rename(from.c_str(), to.c_str()) == 0) {
+            return true;
+        }
+        remove(to.c_str());  // Windows will not rename over an existing file
+        return rename(from.c_str(), to.c_str()) == 0;
+    }
+
+    // Moves the records of `from` onto the end of `to`
+    static bool fold(const string& from, const string& to) {
+        {
+            ifstream source(from, ios::binary);
+            ofstream target(to, ios::binary | ios::app);
+            if (!source.is_open() || !target.is_open()) {
+                return false;
+            }
+            if (source.peek() != ifstream::traits_type::eof()) {
+                target << source.rdbuf();
+            }
+            target.flush();
+            if (!target) {
+                return false;
+            }
+        }
+        return sync(to) && remove(from.c_str()) == 0;
+    }
+
+public:
+    explicit OperationLog(const string& base) : snapshotPath(base + ".snap"), logPath(base + ".log"),
+        frozenPath(base + ".log.1") {}
+
+    ~OperationLog() {
+        flush();
+        if (compactor.joinable()) {
+            compactor.join();
+        }
+    }
+
+    // Snapshot first, then the log a compaction was folding, then the live log
+    vector<string> recoveryFiles() const {
+        return { snapshotPath, frozenPath, logPath };
+    }
+
+    void open() {
+        log.open(logPath, ios::app);
+        log.seekp(0, ios::end);
+        logBytes = (size_t)log.tellp();
+    }
+
+    void append(const string& record) {
+        pending += record;
+        pending += '\n';
+    }
+
+    void flush() {
+        if (pending.empty() || !log.is_open()) {
+            return;
+        }
+        log << pending;
+        log.flush();
+        sync(logPath);
+        logBytes += pending.size();
+        pending.clear();
+    }
+
+    bool needsCompaction() const {
+        return logBytes > LOG_COMPACT_BYTES && !compacting.load();
+    }
+
+    // Freezes the current log and writes the scene as a snapshot in the
+    // background; the frozen log is dropped once the snapshot is in place.
+    // A frozen log left by a crash or a failed snapshot still holds records
+    // the old snapshot lacks, so the current log is folded into it rather
+    // than replacing it.
+    void compact(vector<pair<int, shared_ptr<Shape>>> scene, vector<string> definitions, vector<string> placements,
+        int nextId) {
+        flush();
+        if (compactor.joinable()) {
+            compactor.join();
+        }
+        log.close();
+        bool frozen = ifstream(frozenPath).is_open();
+        if (!(frozen ? fold(logPath, frozenPath) : replace(logPath, frozenPath))) {
+            open();
+            return;
+        }
+        open();
+        compacting.store(true);
+        compactor = thread([this, scene, definitions, placements, nextId]() {
+            string temporary = snapshotPath + ".tmp";
+            {
+                ofstream file(temporary);
+                file << "next " << nextId << "\n";
+                for (const string& definition : definitions) {
+                    file << definition << "\n";
+                }
+                for (auto& entry : scene) {
+                    file << "a " << entry.first << " " << entry.second->serialize() << "\n";
+                }
+                for (const string& placement : placements) {
+                    file << placement << "\n";
+                }
+            }
+            string directory = directoryOf(snapshotPath);
+            if (sync(temporary) && replace(temporary, snapshotPath) && sync(directory)) {
+                remove(frozenPath.c_str());
+                sync(directory);
+            }
+            compacting.store(false);
+        });
+    }
+};
+
+// What one user has picked with select; server clients each keep their own
+struct SelectionState {
+    int selectedId;
+    set<int> group;
+};
+
+const int INDEX_CELL = 8;  // Side of one spatial index bucket, in board cells
+const int MAX_ZOOM = 16;
+const int MAX_VIEW_WIDTH = 1000;  // Largest printed board; its grids are allocated per view
+const int MAX_VIEW_HEIGHT = 1000;
+
+// Coarse grid of buckets over the canvas plus a color lookup, so region and
+// color selections do not have to rasterize or scan every shape.
+class ShapeIndex {
+    // Where an indexed shape sits: its bounds and its position in each
+    // covered bucket, row-major, so erasing it never scans a bucket
+    struct Entry {
+        Bounds bounds;
+        vector<size_t> slots;
+    };
+
+    int columns;
+    unordered_map<int, vector<int>> buckets;  // By row * columns + column; only occupied cells exist
+    map<int, Entry> entries;
+    map<int, string> colors;
+    map<string, set<int>> byColor;
+
+    void bucketRange(const Bounds& b, int& c0, int& r0, int& c1, int& r1) const {
+        c0 = max(0, min(canvasWidth - 1, b.left)) / INDEX_CELL;
+        c1 = max(0, min(canvasWidth - 1, b.right)) / INDEX_CELL;
+        r0 = max(0, min(canvasHeight - 1, b.top)) / INDEX_CELL;
+        r1 = max(0, min(canvasHeight - 1, b.bottom)) / INDEX_CELL;
+    }
+
+public:
+    ShapeIndex() : columns((canvasWidth + INDEX_CELL - 1) / INDEX_CELL) {}
+
+    void insert(int id, const Shape* shape) {
+        erase(id);
+        Entry& entry = entries[id];
+        entry.bounds = shape->bounds();
+        colors[id] = shape->getColor();
+        byColor[shape->getColor()].insert(id);
+
+        int c0, r0, c1, r1;
+        bucketRange(entry.bounds, c0, r0, c1, r1);
+        for (int r = r0; r <= r1; ++r) {
+            for (int c = c0; c <= c1; ++c) {
+                vector<int>& bucket = buckets[r * columns + c];
+                entry.slots.push_back(bucket.size());
+                bucket.push_back(id);
+            }
+        }
+    }
+
+    bool boundsOf(int id, Bounds& b) const {
+        auto it = entries.find(id);
+        if (it == entries.end()) {
+            return false;
+        }
+        b = it->second.bounds;
+        return true;
+    }
+
+    void erase(int id) {
+        auto it = entries.find(id);
+        if (it == entries.end()) {
+            return;
+        }
+        int c0, r0, c1, r1;
+        bucketRange(it->second.bounds, c0, r0, c1, r1);
+        size_t k = 0;
+        for (int r = r0; r <= r1; ++r) {
+            for (int c = c0; c <= c1; ++c, ++k) {
+                auto cell = buckets.find(r * columns + c);
+                vector<int>& bucket = cell->second;
+                size_t slot = it->second.slots[k];
+                int moved = bucket.back();
+                bucket[slot] = moved;
+                bucket.pop_back();
+                if (bucket.empty()) {
+                    buckets.erase(cell);
+                    continue;
+                }
+                if (moved != id) {
+                    // The shape swapped into the hole records its new slot
+                    Entry& other = entries.at(moved);
+                    int oc0, or0, oc1, or1;
+                    bucketRange(other.bounds, oc0, or0, oc1, or1);
+                    other.slots[(r - or0) * (oc1 - oc0 + 1) + (c - oc0)] = slot;
+                }
+            }
+        }
+        byColor[colors[id]].erase(id);
+        colors.erase(id);
+        entries.erase(it);
+    }
+
+    // IDs of shapes whose bounds intersect the area, in ascending (drawing) order
+    vector<int> query(const Bounds& area) const {
+        vector<int> found;
+        int c0, r0, c1, r1;
+        bucketRange(area, c0, r0, c1, r1);
+        auto collect = [&](const vector<int>& bucket) {
+            for (int id : bucket) {
+                if (entries.at(id).bounds.intersects(area)) {
+                    found.push_back(id);
+                }
+            }
+        };
+        // A sparse canvas has fewer occupied cells than the area spans
+        if ((size_t)(r1 - r0 + 1) * (size_t)(c1 - c0 + 1) > buckets.size()) {
+            for (auto& cell : buckets) {
+                int r = cell.first / columns, c = cell.first % columns;
+                if (r >= r0 && r <= r1 && c >= c0 && c <= c1) {
+                    collect(cell.second);
+                }
+            }
+        }
+        else {
+            for (int r = r0; r <= r1; ++r) {
+                for (int c = c0; c <= c1; ++c) {
+                    auto cell = buckets.find(r * columns + c);
+                    if (cell != buckets.end()) {
+                        collect(cell->second);
+                    }
+                }
+            }
+        }
+        sort(found.begin(), found.end());
+        found.erase(unique(found.begin(), found.end()), found.end());
+        return found;
+    }
+
+    vector<int> withColor(const string& color) const {
+        auto it = byColor.find(color);
+        if (it == byColor.end()) {
+            return {};
+        }
+        return vector<int>(it->second.begin(), it->second.end());
+    }
+
+    void clear() {
+        buckets.clear();
+        entries.clear();
+        colors.clear();
+        byColor.clear();
+    }
+};
+
+// One term of a find query, e.g. type=circle,triangle or area>=100 or !filled
+struct FindTerm {
+    string field;
+    bool negated;
+    vector<string> names;  // type / color alternatives
+    bool filled;
+    string op;  // area / id comparison
+    double value;
+    Bounds region;  // inside / touches
+};
+
+// Parses "find <term> ..."; the terms are combined with AND
+bool parseFind(const string& input, vector<FindTerm>& terms, string& error) {
+    istringstream stream(input);
+    string command, word;
+    stream >> command;
+    while (stream >> word) {
+        FindTerm term = { "", false, {}, true, "", 0, { 0, 0, -1, -1 } };
+        if (word[0] == '!') {
+            term.negated = true;
+            word.erase(0, 1);
+        }
+        if (word == "filled" || word == "frame") {
+            term.field = "filled";
+            term.filled = word == "filled";
+            terms.push_back(term);
+            continue;
+        }
+        size_t split = word.find_first_of("=<>!");
+        if (split == string::npos || split == 0) {
+            error = "Invalid term '" + word + "'.";
+            return false;
+        }
+        term.field = word.substr(0, split);
+        size_t valueStart = word.find_first_not_of("=<>!", split);
+        term.op = word.substr(split, valueStart == string::npos ? string::npos : valueStart - split);
+        string value = valueStart == string::npos ? "" : word.substr(valueStart);
+        if (value.empty()) {
+            error = "Missing value in '" + word + "'.";
+            return false;
+        }
+
+        if (term.field == "type" || term.field == "color") {
+            if (term.op != "=") {
+                error = "Use " + term.field + "=<name>[,<name>...].";
+                return false;
+            }
+            istringstream names(value);
+            string name;
+            while (getline(names, name, ',')) {
+                if (term.field == "type" && find(SHAPE_TYPES, SHAPE_TYPES + TYPE_COUNT, name) == SHAPE_TYPES + TYPE_COUNT) {
+                    error = "Unknown shape type '" + name + "'.";
+                    return false;
+                }
+                term.names.push_back(name);
+            }
+        }
+        else if (term.field == "area" || term.field == "id") {
+            static const set<string> ops = { "=", "!=", "<", "<=", ">", ">=" };
+            istringstream number(value);
+            if (!ops.count(term.op) || !(number >> term.value) || !number.eof()) {
+                error = "Use " + term.field + "<op><number> with one of = != < <= > >=.";
+                return false;
+            }
+        }
+        else if (term.field == "inside" || term.field == "touches") {
+            int x, y, width, height;
+            char c1, c2, c3;
+            istringstream numbers(value);
+            if (term.op != "=" || !(numbers >> x >> c1 >> y >> c2 >> width >> c3 >> height) ||
+                c1 != ',' || c2 != ',' || c3 != ',' || width < 1 || height < 1) {
+                error = "Use " + term.field + "=<x>,<y>,<width>,<height>.";
+                return false;
+            }
+            term.region = { x, y, x + width - 1, y + height - 1 };
+        }
+        else if (term.field == "filled") {
+            if (term.op != "=" || (value != "yes" && value != "no")) {
+                error = "Use filled=yes or filled=no.";
+                return false;
+            }
+            term.filled = value == "yes";
+        }
+        else {
+            error = "Unknown attribute '" + term.field + "'.";
+            return false;
+        }
+        terms.push_back(term);
+    }
+    return true;
+}
+
+const size_t TABLE_CHUNK = 4096;  // Rows per ShapeTable chunk
+const size_t CHUNK_WORDS = TABLE_CHUNK / 64;
+const int INDEXED_COLORS = 16;  // Colors with a bitmap; later ones are matched by scanning
+
+// Column-per-attribute copy of the scene for the find command. Rows are
+// appended in insertion order and only marked dead on removal; type, filled
+// and the first INDEXED_COLORS colors (the palette is registered first) keep
+// one bitmap per value, so those terms cost one AND per 64 rows, while rarer
+// colors and the numeric columns are only scanned for rows still in play.
+// Rows sit in fixed-size chunks whose columns grow geometrically, so an
+// insert never touches more than the last chunk.
+class ShapeTable {
+    struct Chunk {
+        vector<int> ids;
+        vector<uint8_t> types;
+        vector<int> colors;  // Color codes
+        vector<double> areas;
+        vector<int> lefts, tops, rights, bottoms;
+        uint64_t live[CHUNK_WORDS] = {};
+        uint64_t filled[CHUNK_WORDS] = {};
+        uint64_t byType[TYPE_COUNT][CHUNK_WORDS] = {};
+        uint64_t byColor[INDEXED_COLORS][CHUNK_WORDS] = {};
+    };
+
+    static void setBit(uint64_t* bits, size_t row, bool on) {
+        uint64_t mask = (uint64_t)1 << (row % 64);
+        if (on) {
+            bits[row / 64] |= mask;
+        }
+        else {
+            bits[row / 64] &= ~mask;
+        }
+    }
+
+    static bool bit(const uint64_t* bits, size_t row) {
+        return (bits[row / 64] >> (row % 64)) & 1;
+    }
+
+public:
+    // What find reads, as of one moment: the chunks and the color names.
+    // Copies share both, so a server can publish one with every scene
+    // version for the cost of its chunk list.
+    class Columns {
+        vector<shared_ptr<const Chunk>> chunks;
+        PersistentMap<string> colorNames;  // By color code
+
+        friend class ShapeTable;
+
+        static bool compare(double lhs, int op, double rhs) {
+            switch (op) {
+            case 0: return lhs == rhs;
+            case 1: return lhs != rhs;
+            case 2: return lhs < rhs;
+            case 3: return lhs <= rhs;
+            case 4: return lhs > rhs;
+            default: return lhs >= rhs;
+            }
+        }
+
+        // Column test of a numeric or region term
+        static bool matches(int field, int op, const FindTerm& term, const Chunk& chunk, size_t row) {
+            const Bounds& r = term.region;
+            switch (field) {
+            case 0: return compare(chunk.areas[row], op, term.value);
+            case 1: return compare(chunk.ids[row], op, term.value);
+            case 2: return chunk.lefts[row] >= r.left && chunk.rights[row] <= r.right && chunk.tops[row] >= r.top &&
+                chunk.bottoms[row] <= r.bottom;
+            default: return chunk.lefts[row] <= r.right && chunk.rights[row] >= r.left && chunk.tops[row] <= r.bottom &&
+                chunk.bottoms[row] >= r.top;
+            }
+        }
+
+        // Bits of the rows a type term, or a color term given as codes, names
+        static void nameBits(const FindTerm& term, const vector<int>& codes, const Chunk& chunk, size_t words,
+            uint64_t* match) {
+            vector<int> scanned;  // Colors without a bitmap
+            if (term.field == "type") {
+                for (const string& name : term.names) {
+                    const uint64_t* bits = chunk.byType[std::find(SHAPE_TYPES, SHAPE_TYPES + TYPE_COUNT, name) - SHAPE_TYPES];
+                    for (size_t w = 0; w < words; ++w) {
+                        match[w] |= bits[w];
+                    }
+                }
+            }
+            for (int code : codes) {
+                if (code >= INDEXED_COLORS) {
+                    scanned.push_back(code);
+                    continue;
+                }
+                for (size_t w = 0; w < words; ++w) {
+                    match[w] |= chunk.byColor[code][w];
+                }
+            }
+            if (scanned.empty()) {
+                return;
+            }
+            for (size_t row = 0; row < chunk.ids.size(); ++row) {
+                if (bit(chunk.live, row) &&
+                    std::find(scanned.begin(), scanned.end(), chunk.colors[row]) != scanned.end()) {
+                    setBit(match, row, true);
+                }
+            }
+        }
+
+        size_t findIn(const Chunk& chunk, const vector<FindTerm>& terms, const vector<vector<int>>& codes,
+            ostream& out) const {
+            static const string OPS[] = { "=", "!=", "<", "<=", ">", ">=" };
+            size_t words = (chunk.ids.size() + 63) / 64;
+            uint64_t result[CHUNK_WORDS];
+            copy(chunk.live, chunk.live + words, result);
+
+            // Bitmap terms first, so the column scans below skip whole words
+            for (size_t t = 0; t < terms.size(); ++t) {
+                const FindTerm& term = terms[t];
+                uint64_t match[CHUNK_WORDS] = {};
+                if (term.field == "type" || term.field == "color") {
+                    nameBits(term, codes[t], chunk, words, match);
+                }
+                else if (term.field == "filled") {
+                    for (size_t w = 0; w < words; ++w) {
+                        match[w] = term.filled ? chunk.filled[w] : chunk.live[w] & ~chunk.filled[w];
+                    }
+                }
+                else {
+                    continue;
+                }
+                for (size_t w = 0; w < words; ++w) {
+                    result[w] &= term.negated ? chunk.live[w] & ~match[w] : match[w];
+                }
+            }
+
+            for (const FindTerm& term : terms) {
+                int field = term.field == "area" ? 0 : term.field == "id" ? 1 : term.field == "inside" ? 2 :
+                    term.field == "touches" ? 3 : -1;
+                if (field < 0) {
+                    continue;
+                }
+                int op = (int)(std::find(OPS, OPS + 6, term.op) - OPS);
+                for (size_t w = 0; w < words; ++w) {
+                    if (result[w] == 0) {
+                        continue;
+                    }
+                    size_t base = w * 64, end = min((size_t)64, chunk.ids.size() - base);
+                    uint64_t keep = 0;
+                    for (size_t b = 0; b < end; ++b) {
+                        keep |= (uint64_t)(matches(field, op, term, chunk, base + b) != term.negated) << b;
+                    }
+                    result[w] &= keep;
+                }
+            }
+
+            size_t found = 0;
+            for (size_t w = 0; w < words; ++w) {
+                for (size_t b = 0; result[w] != 0 && b < 64; ++b) {
+                    if (!((result[w] >> b) & 1)) {
+                        continue;
+                    }
+                    size_t row = w * 64 + b;
+                    out << "ID: " << chunk.ids[row] << " - " << SHAPE_TYPES[chunk.types[row]] << ", color "
+                        << colorNames.at(chunk.colors[row]) << ", " << (bit(chunk.filled, row) ? "filled" : "frame")
+                        << ", area " << chunk.areas[row] << ", bounds (" << chunk.lefts[row] << ", " << chunk.tops[row]
+                        << ")-(" << chunk.rights[row] << ", " << chunk.bottoms[row] << ")\n";
+                    ++found;
+                }
+            }
+            return found;
+        }
+
+    public:
+        // Writes every matching shape straight from the columns; returns the count
+        size_t find(const vector<FindTerm>& terms, ostream& out) const {
+            // Color names become codes once; a name no shape ever had matches nothing
+            vector<vector<int>> codes(terms.size());
+            for (size_t t = 0; t < terms.size(); ++t) {
+                if (terms[t].field != "color") {
+                    continue;
+                }
+                for (auto& entry : colorNames) {
+                    if (std::find(terms[t].names.begin(), terms[t].names.end(), entry.second) != terms[t].names.end()) {
+                        codes[t].push_back(entry.first);
+                    }
+                }
+            }
+            size_t found = 0;
+            for (auto& chunk : chunks) {
+                found += findIn(*chunk, terms, codes, out);
+            }
+            return found;
+        }
+    };
+
+private:
+    vector<shared_ptr<Chunk>> chunks;
+    vector<bool> shared;  // Chunks handed out by share(), copied before they change
+    PersistentMap<string> colorNames;
+    map<string, int> colorCodes;
+    map<int, size_t> rows;
+    size_t size = 0;  // Rows appended so far, live or dead
+    size_t dead = 0;  // Rows of erased shapes, dropped by compact()
+
+    int colorCode(const string& color) {
+        auto it = colorCodes.find(color);
+        if (it != colorCodes.end()) {
+            return it->second;
+        }
+        int code = (int)colorCodes.size();
+        colorNames.set(code, color);
+        return colorCodes[color] = code;
+    }
+
+    Chunk& writable(size_t index) {
+        if (shared[index]) {
+            chunks[index] = make_shared<Chunk>(*chunks[index]);
+            shared[index] = false;
+        }
+        return *chunks[index];
+    }
+
+    // Sets or clears the bitmap bits of one row of a chunk
+    static void mark(Chunk& chunk, size_t row, bool isFilled, bool on) {
+        setBit(chunk.live, row, on);
+        setBit(chunk.filled, row, on && isFilled);
+        setBit(chunk.byType[chunk.types[row]], row, on);
+        if (chunk.colors[row] < INDEXED_COLORS) {
+            setBit(chunk.byColor[chunk.colors[row]], row, on);
+        }
+    }
+
+    void append(int id, uint8_t type, int color, double area, const Bounds& b, bool isFilled) {
+        if (size % TABLE_CHUNK == 0) {
+            chunks.push_back(make_shared<Chunk>());
+            shared.push_back(false);
+        }
+        Chunk& chunk = writable(chunks.size() - 1);
+        chunk.ids.push_back(id);
+        chunk.types.push_back(type);
+        chunk.colors.push_back(color);
+        chunk.areas.push_back(area);
+        chunk.lefts.push_back(b.left);
+        chunk.tops.push_back(b.top);
+        chunk.rights.push_back(b.right);
+        chunk.bottoms.push_back(b.bottom);
+        mark(chunk, chunk.ids.size() - 1, isFilled, true);
+        rows[id] = size++;
+    }
+
+    // Appends the live rows again in order into fresh chunks, leaving any
+    // handed-out ones as they are
+    void compact() {
+        vector<shared_ptr<Chunk>> old;
+        old.swap(chunks);
+        shared.clear();
+        size = 0;
+        for (auto& chunk : old) {
+            for (size_t row = 0; row < chunk->ids.size(); ++row) {
+                if (bit(chunk->live, row)) {
+                    Bounds b = { chunk->lefts[row], chunk->tops[row], chunk->rights[row], chunk->bottoms[row] };
+                    append(chunk->ids[row], chunk->types[row], chunk->colors[row], chunk->areas[row], b,
+                        bit(chunk->filled, row));
+                }
+            }
+        }
+        dead = 0;
+    }
+
+public:
+    // Read-only table over published columns, for find; every chunk counts
+    // as shared, so the columns' other holders never see a write
+    explicit ShapeTable(const Columns& published) : colorNames(published.colorNames) {
+        for (auto& chunk : published.chunks) {
+            chunks.push_back(const_pointer_cast<Chunk>(chunk));
+        }
+        shared.assign(chunks.size(), true);
+    }
+
+    ShapeTable() {
+        colorCode("none");
+        for (int i = 1; i < COLOR_COUNT; ++i) {
+            colorCode(COLOR_NAMES[i]);
+        }
+    }
+
+    void insert(int id, const Shape* shape) {
+        Bounds b = shape->bounds();
+        uint8_t type = (uint8_t)shape->typeIndex();
+        int color = colorCode(shape->getColor());
+        auto it = rows.find(id);
+        if (it == rows.end()) {
+            append(id, type, color, shape->area(), b, shape->getFilled());
+            return;
+        }
+        Chunk& chunk = writable(it->second / TABLE_CHUNK);
+        size_t row = it->second % TABLE_CHUNK;
+        mark(chunk, row, false, false);
+        chunk.types[row] = type;
+        chunk.colors[row] = color;
+        chunk.areas[row] = shape->area();
+        chunk.lefts[row] = b.left;
+        chunk.tops[row] = b.top;
+        chunk.rights[row] = b.right;
+        chunk.bottoms[row] = b.bottom;
+        mark(chunk, row, shape->getFilled(), true);
+    }
+
+    void erase(int id) {
+        auto it = rows.find(id);
+        if (it == rows.end()) {
+            return;
+        }
+        mark(writable(it->second / TABLE_CHUNK), it->second % TABLE_CHUNK, false, false);
+        rows.erase(it);
+        if (++dead > 1024 && dead * 2 > size) {
+            compact();
+        }
+    }
+
+    void clear() {
+        chunks.clear();
+        shared.clear();
+        rows.clear();
+        size = 0;
+        dead = 0;
+    }
+
+    Columns columns() const {
+        Columns view;
+        view.chunks.assign(chunks.begin(), chunks.end());
+        view.colorNames = colorNames;
+        return view;
+    }
+
+    // Columns to hand to another thread: the table copies each of these
+    // chunks before it next changes one, so the copy never sees a write
+    Columns share() {
+        shared.assign(chunks.size(), true);
+        return columns();
+    }
+
+    size_t find(const vector<FindTerm>& terms, ostream& out) const {
+        return columns().find(terms, out);
+    }
+};
+
+bool sameView(const Viewport& a, const Viewport& b) {
+    return a.x == b.x && a.y == b.y && a.width == b.width && a.height == b.height && a.scale == b.scale;
+}
+
+// Named group of shapes with its own place in the drawing order. The raster
+// caches the layer's shapes for the current view, so hiding, showing or
+// reordering layers only recomposites, and an edit re-renders the damaged
+// areas of one layer.
+struct Layer {
+    string name;
+    bool visible = true;
+    set<int> ids;  // Drawing order within the layer
+    Board raster;
+    bool dirty = true;  // Raster no longer matches ids
+    vector<Bounds> damage;  // Canvas areas to re-render before the next composite
+
+    explicit Layer(const string& layerName) : name(layerName) {}
+
+    bool current(const Board& board) const {
+        return !dirty && raster.braille == board.braille && sameView(raster.view, board.view);
+    }
+};
+
+const size_t MAX_DAMAGE = 64;  // Damaged areas per layer before it is re-rendered whole
+
+// Scene version kept by snapshot: the shape and layer maps share structure
+// with the live scene, so taking one copies two pointers
+struct SceneSnapshot {
+    PersistentMap<shared_ptr<Shape>> shapes;
+    PersistentMap<string> shapeLayers;
+    int currentId;
+};
+
+// Everything a read-only scene is rebuilt from. The shape maps are shared, so
+// taking one costs O(layers + symbols + snapshots) whatever the scene size.
+struct SceneVersion {
+    SceneSnapshot scene;
+    vector<pair<string, bool>> layers;  // Name and visibility, bottom first
+    string activeLayer;
+    SymbolTable symbols;
+    map<string, SceneSnapshot> snapshots;
+    ShapeTable::Columns table;
+};
+
+class Commands {
+    PersistentMap<shared_ptr<Shape>> shapes;  // Map for storing shapes with unique IDs
+    PersistentMap<string> shapeLayers;  // Layer of each shape
+    map<string, SceneSnapshot> snapshots;
+    int currentId = 0;
+    set<string> placedShapes;  // Set for storing serialized shape details to ensure uniqueness
+    int selectedId = -1;  // Track the last selected shape ID
+    set<int> selection;  // Group picked by select rect / select color
+    ShapeIndex index;
+    ShapeTable table;  // Columns and bitmaps for find
+    vector<Layer> layers;  // Bottom to top
+    SymbolTable symbols;
+    string activeLayer = "base";  // Layer new shapes go into
+    bool deferRendering = false;  // Rendering happens elsewhere (render thread)
+    bool referenceEngine = false;  // Per-pixel draw/drawShape only, for differential testing
+    bool indexed = true;  // False in a read-only view, which has no index, placedShapes or layer ids
+    OperationLog* journal = nullptr;
+
+    void record(const char* op, int id) {
+        if (journal != nullptr) {
+            journal->append(string(op) + " " + to_string(id) + (shapes.count(id) ? " " + shapes.at(id)->serialize() : ""));
+        }
+    }
+
+    Layer* findLayer(const string& name) {
+        for (auto& layer : layers) {
+            if (layer.name == name) {
+                return &layer;
+            }
+        }
+        return nullptr;
+    }
+
+    Layer& layerOf(int id) {
+        Layer* layer = shapeLayers.count(id) ? findLayer(shapeLayers.at(id)) : nullptr;
+        return layer != nullptr ? *layer : *findLayer(activeLayer);
+    }
+
+    // Shapes of each layer in drawing order, bottom layer first, taken from
+    // the maps alone (as layerOf places them) so a read-only view has it too
+    vector<vector<const Shape*>> layerMembers() const {
+        auto position = [this](const string& name) {
+            size_t k = 0;
+            while (k < layers.size() && layers[k].name != name) {
+                ++k;
+            }
+            return k;
+        };
+        vector<vector<const Shape*>> members(layers.size());
+        size_t fallback = position(activeLayer);
+        auto layer = shapeLayers.begin();
+        for (auto& entry : shapes) {
+            while (layer != shapeLayers.end() && layer->first < entry.first) {
+                ++layer;
+            }
+            size_t k = layer != shapeLayers.end() && layer->first == entry.first ? position(layer->second) : fallback;
+            members[k < members.size() ? k : fallback].push_back(entry.second.get());
+        }
+        return members;
+    }
+
+    // Marks a canvas area of a layer for re-rendering; past MAX_DAMAGE areas
+    // the whole layer is rendered again instead
+    void damage(Layer& layer, const Bounds& area) {
+        if (layer.dirty) {
+            return;
+        }
+        if (layer.damage.size() >= MAX_DAMAGE) {
+            layer.dirty = true;
+            layer.damage.clear();
+            return;
+        }
+        layer.damage.push_back(area);
+    }
+
+    void addToLayer(int id, const string& name) {
+        shapeLayers.set(id, name);
+        findLayer(name)->ids.insert(id);
+    }
+
+    void moveToLayer(int id, const string& name) {
+        Layer& from = layerOf(id);
+        Bounds b = shapes.at(id)->bounds();
+        from.ids.erase(id);
+        damage(from, b);
+        addToLayer(id, name);
+        damage(*findLayer(name), b);
+    }
+
+    // The layer stack as log records: "layers <name> <visible> ...", bottom
+    // first, then "active <name>"
+    vector<string> layerDefinitions() const {
+        string stack = "layers";
+        for (auto& layer : layers) {
+            stack += " " + layer.name + (layer.visible ? " 1" : " 0");
+        }
+        return { stack, "active " + activeLayer };
+    }
+
+    void recordLayers() {
+        if (journal != nullptr) {
+            for (const string& line : layerDefinitions()) {
+                journal->append(line);
+            }
+        }
+    }
+
+    void recordPlacement(int id) {
+        if (journal != nullptr) {
+            journal->append("l " + to_string(id) + " " + shapeLayers.at(id));
+        }
+    }
+
+    // Rebuilds the layer stack from a "layers" record; layers it does not
+    // name stay on top
+    bool applyLayers(istream& stream) {
+        vector<Layer> stack;
+        vector<bool> taken(layers.size(), false);
+        string name;
+        int visible;
+        while (stream >> name >> visible) {
+            size_t k = 0;
+            while (k < layers.size() && (taken[k] || layers[k].name != name)) {
+                ++k;
+            }
+            if (k < layers.size()) {
+                taken[k] = true;
+                stack.push_back(layers[k]);
+            }
+            else {
+                stack.push_back(Layer(name));
+            }
+            stack.back().visible = visible != 0;
+        }
+        if (stack.empty()) {
+            return false;
+        }
+        for (size_t k = 0; k < layers.size(); ++k) {
+            if (!taken[k]) {
+                stack.push_back(layers[k]);
+            }
+        }
+        layers.swap(stack);
+        if (findLayer(activeLayer) == nullptr) {
+            activeLayer = layers.back().name;
+        }
+        return true;
+    }
+
+    // Registers a parsed definition; a name keeps its first definition
+    bool addSymbol(shared_ptr<const Symbol> symbol) {
+        if (symbol == nullptr || symbols.count(symbol->name)) {
+            return false;
+        }
+        symbols[symbol->name] = symbol;
+        if (journal != nullptr) {
+            journal->append(symbol->definition());
+        }
+        return true;
+    }
+
+    vector<string> symbolDefinitions() const {
+        vector<string> definitions;
+        for (auto& entry : symbols) {
+            definitions.push_back(entry.second->definition());
+        }
+        return definitions;
+    }
+
+    int storeShape(Shape* shape) {
+        shapes.set(++currentId, shared_ptr<Shape>(shape));
+        addToLayer(currentId, activeLayer);
+        placedShapes.insert(shape->serialize());
+        index.insert(currentId, shape);
+        table.insert(currentId, shape);
+        record("a", currentId);
+        recordPlacement(currentId);
+        return currentId;
+    }
+
+    // Keeps the uniqueness set and the indexes in step after a shape was
+    // replaced by an edited copy
+    void shapeChanged(int id, const string& before) {
+        Shape* shape = shapes.at(id).get();
+        Bounds old;
+        if (index.boundsOf(id, old)) {
+            damage(layerOf(id), old);
+        }
+        placedShapes.erase(before);
+        placedShapes.insert(shape->serialize());
+        index.insert(id, shape);
+        table.insert(id, shape);
+        damage(layerOf(id), shape->bounds());
+        record("u", id);
+    }
+
+    // Copy-on-write: map nodes are shared with snapshots and shapes with
+    // published frames, so a shape is always cloned (and its path in the map
+    // copied) before it changes
+    Shape* editable(int id) {
+        Shape* copy = shapes.at(id)->clone();
+        shapes.set(id, shared_ptr<Shape>(copy));
+        return copy;
+    }
+
+    // Drops a shape from the derived structures, leaving the maps alone
+    void unindex(int id, const Shape* shape) {
+        placedShapes.erase(shape->serialize());
+        index.erase(id);
+        table.erase(id);
+        Layer& layer = layerOf(id);
+        layer.ids.erase(id);
+        damage(layer, shape->bounds());
+    }
+
+    void discardShape(int id) {
+        unindex(id, shapes.at(id).get());
+        selection.erase(id);
+        if (selectedId == id) {
+            selectedId = -1;
+        }
+        shapes.erase(id);
+        shapeLayers.erase(id);
+        record("r", id);
+    }
+
+public:
+    Commands() : layers(1, Layer("base")) {}
+
+    // Read-only view of a published version for the query commands. It
+    // shares the maps and the find columns and builds nothing per shape:
+    // queries that would use the index or layer ids scan the maps instead.
+    explicit Commands(const SceneVersion& version) : shapes(version.scene.shapes),
+        shapeLayers(version.scene.shapeLayers), snapshots(version.snapshots), currentId(version.scene.currentId),
+        table(version.table), symbols(version.symbols), activeLayer(version.activeLayer), indexed(false) {
+        for (auto& entry : version.layers) {
+            layers.push_back(Layer(entry.first));
+            layers.back().visible = entry.second;
+        }
+    }
+
+    // Costs O(layers + snapshots + table chunks) for any scene size
+    SceneVersion version() {
+        SceneVersion v = { { shapes, shapeLayers, currentId }, {}, activeLayer, symbols, snapshots, table.share() };
+        for (auto& layer : layers) {
+            v.layers.push_back(make_pair(layer.name, layer.visible));
+        }
+        return v;
+    }
+
+    // Optional trailing opacity percent of a filled shape
+    bool readOpacity(istringstream& stream, Shape* shape) {
+        int opacity;
+        if (!(stream >> opacity)) {
+            return true;
+        }
+        if (opacity < 1 || opacity > 100) {
+            console() << "Invalid opacity. Use a percentage from 1 to 100.\n";
+            return false;
+        }
+        shape->setOpacity(opacity);
+        return true;
+    }
+
+    bool shapeExists(const Shape* shape) const {
+        return placedShapes.find(shape->serialize()) != placedShapes.end();
+    }
+
+    void addShape(const string& command, Board& board) {
+        TRACE_SCOPE("addShape");
+        istringstream stream(command);
+        string action, shapeType, triangleType;
+        stream >> action >> shapeType;
+
+        if (action != "add" || stream.fail()) {
+            console() << "Invalid command format. Avalible commands are: add, shapes, draw, save, load, undo, clear, exit.\n";
+            return;
+        }
+        bool isFill = false;
+        string color, figure;
+        if (shapeType == "fill") {
+			isFill = true;
+            stream >> color >> figure;
+            if (figure == "circle") {
+                int x, y, radius;
+                if (!(stream >> x >> y >> radius)) {
+                    console() << "Invalid parameters for circle. Use: add circle <centerX> <centerY> <radius> <color>\n";
+                    return;
+                }
+                Circle* circle = new Circle(x, y, radius);
+                circle->setColor(color);
+                circle->setFilled(isFill);
+                if (!readOpacity(stream, circle)) {
+                    delete circle;
+                    return;
+                }
+                if (!circle->fitsOnBoard()) {
+                    console() << "Circle's area exceeds board size. Cannot draw.\n";
+                    delete circle;
+                    return;
+                }
+                if (circle->isInsideBoard() && !shapeExists(circle)) {
+                    storeShape(circle);
+                    renderNew(circle, board);
+                }
+                else {
+                    console() << "Invalid circle placement. Either out of bounds or shape already exists.\n";
+                    delete circle;
+                }
+            }
+            else if (figure == "rectangle") {
+                isFill = true;
+                int x, y, width, height;
+                if (!(stream >> x >> y >> width >> height)) {
+                    console() << "Invalid parameters for rectangle. Use: add rectangle <leftX> <topY> <width> <height>\n";
+                    return;
+                }
+                Rectangle* rectangle = new Rectangle(x, y, width, height);
+                rectangle->setColor(color);
+                rectangle->setFilled(isFill);
+                if (!readOpacity(stream, rectangle)) {
+                    delete rectangle;
+                    return;
+                }
+                if (!rectangle->fitsOnBoard()) {
+                    console() << "Rectangle's area exceeds board size. Cannot draw.\n";
+                    delete rectangle;
+                    return;
+                }
+                if (rectangle->isInsideBoard() && !shapeExists(rectangle)) {
+                    storeShape(rectangle);
+                    renderNew(rectangle, board);
+                }
+                else {
+                    console() << "Invalid rectangle placement. Either out of bounds or shape already exists.\n";
+                    delete rectangle;
+                }
+            }
+            else if (figure == "triangle") {
+                isFill = true;
+                stream >> triangleType;
+                int x, y, length;
+                if (!(stream >> x >> y >> length) || (triangleType != "right" && triangleType != "equal")) {
+                    console() << "Invalid parameters for triangle. Use: add triangle <type> <leftX> <topY> <length> (type: right/equal)\n";
+                    return;
+                }
+                Triangle* triangle = new Triangle(x, y, length, triangleType);
+                triangle->setColor(color);
+                triangle->setFilled(isFill);
+                if (!readOpacity(stream, triangle)) {
+                    delete triangle;
+                    return;
+                }
+                if (!triangle->fitsOnBoard()) {
+                    console() << "Triangle's area exceeds board size. Cannot draw.\n";
+                    delete triangle;
+                    return;
+                }
+                if (triangle->isInsideBoard() && !shapeExists(triangle)) {
+                    storeShape(triangle);
+                    renderNew(triangle, board);
+                }
+                else {
+                    console() << "Invalid triangle placement. Either out of bounds or shape already exists.\n";
+                    delete triangle;
+                }
+            }
+
+        }
+        else {
+            if (shapeType == "circle") {
+                int x, y, radius;
+                if (!(stream >> x >> y >> radius)) {
+                    console() << "Invalid parameters for circle. Use: add circle <centerX> <centerY> <radius>\n";
+                    return;
+                }
+                Circle* circle = new Circle(x, y, radius);
+                if (!circle->fitsOnBoard()) {
+                    console() << "Circle's area exceeds board size. Cannot draw.\n";
+                    delete circle;
+                    return;
+                }
+                if (circle->isInsideBoard() && !shapeExists(circle)) {
+                    storeShape(circle);
+                    renderNew(circle, board);
+                }
+                else {
+                    console() << "Invalid circle placement. Either out of bounds or shape already exists.\n";
+                    delete circle;
+                }
+            }
+            else if (shapeType == "rectangle") {
+                int x, y, width, height;
+                if (!(stream >> x >> y >> width >> height)) {
+                    console() << "Invalid parameters for rectangle. Use: add rectangle <leftX> <topY> <width> <height>\n";
+                    return;
+                }
+                Rectangle* rectangle = new Rectangle(x, y, width, height);
+                if (!rectangle->fitsOnBoard()) {
+                    console() << "Rectangle's area exceeds board size. Cannot draw.\n";
+                    delete rectangle;
+                    return;
+                }
+                if (rectangle->isInsideBoard() && !shapeExists(rectangle)) {
+                    storeShape(rectangle);
+                    renderNew(rectangle, board);
+                }
+                else {
+                    console() << "Invalid rectangle placement. Either out of bounds or shape already exists.\n";
+                    delete rectangle;
+                }
+            }
+            else if (shapeType == "triangle") {
+                stream >> triangleType;
+                int x, y, length;
+                if (!(stream >> x >> y >> length) || (triangleType != "right" && triangleType != "equal")) {
+                    console() << "Invalid parameters for triangle. Use: add triangle <type> <leftX> <topY> <length> (type: right/equal)\n";
+                    return;
+                }
+                Triangle* triangle = new Triangle(x, y, length, triangleType);
+                if (!triangle->fitsOnBoard()) {
+                    console() << "Circle's area exceeds board size. Cannot draw.\n";
+                    delete triangle;
+                    return;
+                }
+                if (triangle->isInsideBoard() && !shapeExists(triangle)) {
+                    storeShape(triangle);
+                    renderNew(triangle, board);
+                }
+                else {
+                    console() << "Invalid triangle placement. Either out of bounds or shape already exists.\n";
+                    delete triangle;
+                }
+            }
+            else {
+                console() << "Unknown shape type. Available shapes are circle, rectangle, triangle.\n";
+            }
+        }   
+    }
+
+    // Share of the canvas covered by at least one shape, rasterized one
+    // printable tile at a time so a large canvas never needs a board its size
+    void coverage() const {
+        long long covered = 0;
+        for (int top = 0; top < canvasHeight; top += MAX_VIEW_HEIGHT) {
+            for (int left = 0; left < canvasWidth; left += MAX_VIEW_WIDTH) {
+                Board board({ left, top, min(MAX_VIEW_WIDTH, canvasWidth - left), min(MAX_VIEW_HEIGHT, canvasHeight - top), 1 });
+                rasterize(board);
+                for (auto& row : board.grid) {
+                    covered += count_if(row.begin(), row.end(), [](char c) { return c != ' '; });
+                }
+            }
+        }
+        console() << "Coverage: " << covered << " of " << canvasArea() << " cells ("
+            << covered * 100 / canvasArea() << "%).\n";
+    }
+
+    // Rebuilds the scene from the autosave files, then logs further mutations
+    void recover(OperationLog& log) {
+        int replayed = 0;
+        for (const string& path : log.recoveryFiles()) {
+            ifstream file(path);
+            string line;
+            while (getline(file, line)) {
+                replayed += applyRecord(line) ? 1 : 0;
+            }
+        }
+        if (replayed > 0) {
+            console() << "Recovered " << shapes.size() << " shapes from the autosave.\n";
+        }
+        log.open();
+        journal = &log;
+    }
+
+    // Applies one snapshot line or log record without logging it again
+    bool applyRecord(const string& line) {
+        istringstream stream(line);
+        string op;
+        int id;
+        stream >> op;
+        if (op == "symbol") {
+            return addSymbol(parseSymbol(line, symbols));
+        }
+        if (op == "layers") {
+            return applyLayers(stream);
+        }
+        if (op == "active") {
+            string name;
+            stream >> name;
+            if (findLayer(name) == nullptr) {
+                return false;
+            }
+            activeLayer = name;
+            return true;
+        }
+        if (!(stream >> id)) {
+            return false;
+        }
+        if (op == "next") {
+            currentId = max(currentId, id);
+            return true;
+        }
+        if (op == "l") {
+            string name;
+            if (!(stream >> name) || !shapes.count(id) || findLayer(name) == nullptr) {
+                return false;
+            }
+            moveToLayer(id, name);
+            return true;
+        }
+
+        // New shapes go into the active layer until an "l" record moves them;
+        // an update keeps the shape where it was
+        string layerName = activeLayer;
+        if (shapes.count(id)) {
+            layerName = shapeLayers.at(id);
+            discardShape(id);
+        }
+        if (op == "r") {
+            return true;
+        }
+        string rest;
+        getline(stream, rest);
+        Shape* shape = (op == "a" || op == "u") ? parseShape(rest, symbols) : nullptr;
+        if (shape == nullptr) {
+            return false;
+        }
+        shapes.set(id, shared_ptr<Shape>(shape));
+        placedShapes.insert(shape->serialize());
+        index.insert(id, shape);
+        table.insert(id, shape);
+        addToLayer(id, layerName);
+        damage(*findLayer(layerName), shape->bounds());
+        currentId = max(currentId, id);
+        return true;
+    }
+
+    // Writes out this command's log records; compacts the log when it is large
+    void flushLog() {
+        if (journal == nullptr) {
+            return;
+        }
+        journal->flush();
+        if (journal->needsCompaction()) {
+            vector<string> definitions = symbolDefinitions(), placements;
+            for (const string& line : layerDefinitions()) {
+                definitions.push_back(line);
+            }
+            for (auto& entry : shapeLayers) {
+                if (entry.second != activeLayer) {
+                    placements.push_back("l " + to_string(entry.first) + " " + entry.second);
+                }
+            }
+            journal->compact(vector<pair<int, shared_ptr<Shape>>>(shapes.begin(), shapes.end()), definitions, placements,
+                currentId);
+        }
+    }
+
+    void setDeferredRendering(bool deferred) {
+        deferRendering = deferred;
+    }
+
+    // Snapshot for the render thread; O(layers), as the maps are shared, not copied
+    shared_ptr<const Frame> frame(const Board& board) const {
+        shared_ptr<Frame> snapshot = make_shared<Frame>();
+        snapshot->shapes = shapes;
+        snapshot->shapeLayers = shapeLayers;
+        for (auto& layer : layers) {
+            if (layer.visible) {
+                snapshot->layers.push_back(layer.name);
+            }
+        }
+        snapshot->view = board.view;
+        snapshot->braille = board.braille;
+        return snapshot;
+    }
+
+    // Full render of the visible layers, bottom to top, without the layer
+    // caches; only shapes whose bounds reach into the viewport are rasterized
+    void rasterize(Board& board) const {
+        if (!indexed) {
+            renderFrame(*frame(board), board);
+            return;
+        }
+        board.clear();
+        vector<int> visible = referenceEngine ? vector<int>() : index.query(board.visibleArea());
+        for (auto& layer : layers) {
+            if (!layer.visible) {
+                continue;
+            }
+            if (referenceEngine) {
+                for (int id : layer.ids) {
+                    renderReference(shapes.at(id).get(), board);
+                }
+                continue;
+            }
+            for (int id : visible) {
+                if (layer.ids.count(id)) {
+                    renderShape(shapes.at(id).get(), board);
+                }
+            }
+        }
+    }
+
+    // Small layers cull their own shapes; large ones go through the index
+    void renderLayer(Layer& layer, const Board& board) {
+        TRACE_SCOPE("renderLayer");
+        layer.raster.braille = board.braille;
+        layer.raster.setViewport(board.view);
+        Bounds visible = board.visibleArea();
+        if (layer.ids.size() * 4 < shapes.size()) {
+            for (int id : layer.ids) {
+                Shape* shape = shapes.at(id).get();
+                if (shape->bounds().intersects(visible)) {
+                    renderShape(shape, layer.raster);
+                }
+            }
+        }
+        else {
+            for (int id : index.query(visible)) {
+                if (layer.ids.count(id)) {
+                    renderShape(shapes.at(id).get(), layer.raster);
+                }
+            }
+        }
+        layer.dirty = false;
+        layer.damage.clear();
+    }
+
+    // Re-renders the damaged areas of a current layer. Each area is widened to
+    // whole board cells and rendered on its own small board, which is then
+    // pasted over the raster.
+    void repairLayer(Layer& layer, const Board& board) {
+        TRACE_SCOPE("repairLayer");
+        const Viewport& v = board.view;
+        auto cellOf = [&v](int canvas, int origin) {
+            int offset = canvas - origin;
+            return offset >= 0 ? offset / v.scale : -((-offset + v.scale - 1) / v.scale);
+        };
+        for (const Bounds& area : layer.damage) {
+            int c0 = max(0, cellOf(area.left, v.x)), c1 = min(v.width - 1, cellOf(area.right, v.x));
+            int r0 = max(0, cellOf(area.top, v.y)), r1 = min(v.height - 1, cellOf(area.bottom, v.y));
+            if (c0 > c1 || r0 > r1) {
+                continue;
+            }
+            Board part({ v.x + c0 * v.scale, v.y + r0 * v.scale, c1 - c0 + 1, r1 - r0 + 1, v.scale });
+            if (board.braille) {
+                part.setBraille(true);
+            }
+            for (int id : index.query(part.visibleArea())) {
+                if (layer.ids.count(id)) {
+                    renderShape(shapes.at(id).get(), part);
+                }
+            }
+            layer.raster.paste(part, c0, r0);
+        }
+        layer.damage.clear();
+    }
+
+    // Draws a newly placed shape of the active layer. The layer's cached
+    // raster takes it directly; the board does too unless a visible layer
+    // lies above, in which case it is recomposited.
+    void renderNew(Shape* shape, Board& board) {
+        TRACE_SCOPE("renderNew");
+        if (deferRendering) {
+            return;
+        }
+        Layer& layer = *findLayer(activeLayer);
+        if (layer.current(board) && !referenceEngine) {
+            renderShape(shape, layer.raster);
+        }
+        else {
+            layer.dirty = true;
+        }
+        if (!layer.visible) {
+            return;
+        }
+        bool covered = false;
+        for (size_t k = &layer - &layers[0] + 1; k < layers.size(); ++k) {
+            covered = covered || layers[k].visible;
+        }
+        if (covered) {
+            drawAllShapes(board);
+        }
+        else if (referenceEngine) {
+            renderReference(shape, board);
+        }
+        else {
+            renderShape(shape, board);
+        }
+    }
+
+    void setReferenceEngine(bool reference) {
+        referenceEngine = reference;
+    }
+
+    // Re-rasterizes only the layers whose shapes or view changed, then
+    // composites the visible layers onto the board
+    void drawAllShapes(Board& board) {
+        TRACE_SCOPE("drawAllShapes");
+        if (deferRendering) {
+            return;
+        }
+        if (referenceEngine) {
+            rasterize(board);
+            return;
+        }
+        board.clear();
+        for (auto& layer : layers) {
+            if (!layer.visible) {
+                continue;
+            }
+            if (!layer.current(board)) {
+                renderLayer(layer, board);
+            }
+            else if (!layer.damage.empty()) {
+                repairLayer(layer, board);
+            }
+            board.composite(layer.raster);
+        }
+    }
+
+    // layer [list] | add <name> | use <name> | hide <name> | show <name> |
+    // up <name> | down <name> | put <name> | remove <name>
+    void layer(const string& input, Board& board) {
+        istringstream stream(input);
+        string command, action, name;
+        stream >> command >> action >> name;
+        if (action.empty() || action == "list") {
+            console() << "Layers, top first:\n";
+            for (size_t k = layers.size(); k-- > 0;) {
+                const Layer& layer = layers[k];
+                console() << "  " << layer.name << " - " << layer.ids.size() << " shapes"
+                    << (layer.visible ? "" : ", hidden") << (layer.name == activeLayer ? ", active" : "") << "\n";
+            }
+            return;
+        }
+        if (name.empty()) {
+            console() << "Missing layer name. Use: layer add|use|hide|show|up|down|put|remove <name>\n";
+            return;
+        }
+        Layer* target = findLayer(name);
+        if (action == "add") {
+            if (target != nullptr) {
+                console() << "Layer " << name << " already exists.\n";
+                return;
+            }
+            layers.push_back(Layer(name));
+            activeLayer = name;
+            recordLayers();
+            console() << "Layer " << name << " added on top and made active.\n";
+            return;
+        }
+        if (target == nullptr) {
+            console() << "No layer named " << name << ".\n";
+            return;
+        }
+        size_t position = target - &layers[0];
+        if (action == "use") {
+            activeLayer = name;
+            recordLayers();
+            console() << "New shapes go into layer " << name << ".\n";
+        }
+        else if (action == "hide" || action == "show") {
+            target->visible = action == "show";
+            recordLayers();
+            drawAllShapes(board);
+            console() << "Layer " << name << (target->visible ? " shown.\n" : " hidden.\n");
+        }
+        else if (action == "up" || action == "down") {
+            size_t other = action == "up" ? position + 1 : position - 1;
+            if ((action == "up" && position + 1 >= layers.size()) || (action == "down" && position == 0)) {
+                console() << "Layer " << name << " is already at the " << (action == "up" ? "top" : "bottom") << ".\n";
+                return;
+            }
+            swap(layers[position], layers[other]);
+            recordLayers();
+            drawAllShapes(board);
+            console() << "Layer " << name << " moved " << action << ".\n";
+        }
+        else if (action == "put") {
+            set<int> moving = selection;
+            if (moving.empty() && selectedId != -1) {
+                moving.insert(selectedId);
+            }
+            if (moving.empty()) {
+                console() << "No shape is currently selected.\n";
+                return;
+            }
+            for (int id : moving) {
+                moveToLayer(id, name);
+                recordPlacement(id);
+            }
+            drawAllShapes(board);
+            console() << moving.size() << " shapes moved to layer " << name << ".\n";
+        }
+        else if (action == "remove") {
+            if (!target->ids.empty() || layers.size() == 1) {
+                console() << "Only an empty layer can be removed, and one layer always remains.\n";
+                return;
+            }
+            layers.erase(layers.begin() + position);
+            if (activeLayer == name) {
+                activeLayer = layers.back().name;
+            }
+            recordLayers();
+            drawAllShapes(board);
+            console() << "Layer " << name << " removed.\n";
+        }
+        else {
+            console() << "Unknown layer action. Use: layer list|add|use|hide|show|up|down|put|remove\n";
+        }
+    }
+
+    void exportImage(const string& input, const Board& board) const {
+        istringstream stream(input);
+        string command, filename;
+        stream >> command >> filename;
+        if (board.braille) {
+            console() << "Image export works on the ascii raster. Switch with: mode ascii\n";
+            return;
+        }
+        Board image(board.view);
+        rasterize(image);
+        if (filename.empty() || !image.exportImage(filename)) {
+            console() << "Could not open file for export.\n";
+            return;
+        }
+        console() << "Board exported to " << filename << ".\n";
+    }
+
+    void setMode(const string& input, Board& board) {
+        istringstream stream(input);
+        string command, mode;
+        stream >> command >> mode;
+
+        if (mode == "braille") {
+            board.setBraille(true);
+        }
+        else if (mode == "ascii") {
+            board.setBraille(false);
+        }
+        else {
+            console() << "Unknown mode. Use: mode ascii or mode braille\n";
+            return;
+        }
+        drawAllShapes(board);
+        console() << "Rendering mode set to " << mode << ".\n";
+    }
+
+    void setView(const string& input, Board& board) {
+        istringstream stream(input);
+        string command, arg;
+        stream >> command >> arg;
+
+        if (arg.empty() || arg == "reset") {
+            board.setViewport(homeView());
+            drawAllShapes(board);
+            bool whole = board.view.width == canvasWidth && board.view.height == canvasHeight;
+            console() << "Viewport reset to " << (whole ? "the full board" : "the top-left corner of the canvas") << ".\n";
+            return;
+        }
+
+        Viewport v = { 0, 0, 0, 0, 1 };
+        istringstream params(input);
+        if (!(params >> command >> v.x >> v.y >> v.width >> v.height) || v.width <= 0 || v.height <= 0) {
+            console() << "Invalid viewport. Use: view <x> <y> <width> <height> or view reset\n";
+            return;
         }
-        else if (type == "equal") {
-            return (x - newLength + 1 >= 0) && (x + newLength - 1 < BOARD_WIDTH) &&
-                (y + newLength < BOARD_HEIGHT);
+        if (v.width > MAX_VIEW_WIDTH || v.height > MAX_VIEW_HEIGHT) {
+            console() << "Viewport too large. The most it can show is " << MAX_VIEW_WIDTH << "x" << MAX_VIEW_HEIGHT << ".\n";
+            return;
         }
-
-        return false;
+        board.setViewport(v);
+        drawAllShapes(board);
+        console() << "Viewport set to (" << v.x << ", " << v.y << "), " << v.width << "x" << v.height << ".\n";
     }
 
-
-    void applyEdit(const vector<int>& newParams) override {
-        if (newParams.size() == 1) {
-            length = newParams[0];
-        }
-        else {
-            cout << "Invalid parameters for editing Triangle. Expected 1 parameter (length).\n";
+    void pan(const string& input, Board& board) {
+        istringstream stream(input);
+        string command;
+        int dx, dy;
+        if (!(stream >> command >> dx >> dy)) {
+            console() << "Invalid offset. Use: pan <dx> <dy>\n";
+            return;
         }
+        Viewport v = board.view;
+        v.x += dx;
+        v.y += dy;
+        board.setViewport(v);
+        drawAllShapes(board);
+        console() << "Viewport moved to (" << v.x << ", " << v.y << ").\n";
     }
 
-    string info() const override {
-        return "Triangle (" + to_string(x) + ", " + to_string(y) + "), length: " + to_string(length) + ", type: " + type
-            + ", color " + color + ", " + (isFilled ? "filled" : "frame");
-    }
+    void zoom(const string& input, Board& board) {
+        istringstream stream(input);
+        string command, arg;
+        stream >> command >> arg;
 
-    string serialize() const override {
-        return "triangle " + type + " " + to_string(x) + " " + to_string(y) + " " + to_string(length) 
-            + color + ", " + (isFilled ? "filled" : "frame");
-    }
+        Viewport v = board.view;
+        int newScale;
+        if (arg == "in") {
+            newScale = max(1, v.scale / 2);
+        }
+        else if (arg == "out") {
+            newScale = min(MAX_ZOOM, v.scale * 2);
+        }
+        else if (!(stringstream(arg) >> newScale) || newScale < 1 || newScale > MAX_ZOOM) {
+            console() << "Invalid zoom. Use: zoom in, zoom out or zoom <1-" << MAX_ZOOM << ">\n";
+            return;
+        }
 
-    bool isInsideBoard() const override {
-        return (type == "right" && x >= 0 && x <= BOARD_WIDTH && y >= 0 && y <= BOARD_HEIGHT) ||
-            (type == "equal" && x >= 0 && x < BOARD_WIDTH && y >= 0 && y <= BOARD_HEIGHT);
+        // Keep the canvas point in the middle of the viewport where it is
+        int centerX = v.x + v.width * v.scale / 2;
+        int centerY = v.y + v.height * v.scale / 2;
+        v.scale = newScale;
+        v.x = centerX - v.width * v.scale / 2;
+        v.y = centerY - v.height * v.scale / 2;
+        board.setViewport(v);
+        drawAllShapes(board);
+        console() << "Zoom set to 1:" << v.scale << ".\n";
     }
-};
-
-class Commands {
-    map<int, Shape*> shapes;  // Map for storing shapes with unique IDs
-    int currentId = 0;
-    set<string> placedShapes;  // Set for storing serialized shape details to ensure uniqueness
-    int selectedId = -1;  // Track the last selected shape ID
 
-public:
-    ~Commands() {
+    void listShapes() const {
+        if (shapes.empty()) {
+            console() << "No shapes added.\n";
+            return;
+        }
+        console() << "List of shapes:\n";
         for (auto& pair : shapes) {
-            delete pair.second;
+            console() << "ID: " << pair.first << " - " << pair.second->info() << "\n";
         }
     }
 
-    bool shapeExists(const Shape* shape) {
-        return placedShapes.find(shape->serialize()) != placedShapes.end();
-    }
-
-    void addShape(const string& command, Board& board) {
-        istringstream stream(command);
-        string action, shapeType, triangleType;
-        stream >> action >> shapeType;
-
-        if (action != "add" || stream.fail()) {
-            cout << "Invalid command format. Avalible commands are: add, shapes, draw, save, load, undo, clear, exit.\n";
+    // symbol define <name> | place <name> <x> <y> [color] | list
+    void symbol(const string& input, Board& board) {
+        istringstream stream(input);
+        string command, action, name;
+        stream >> command >> action >> name;
+        if (action == "list" || action.empty()) {
+            if (symbols.empty()) {
+                console() << "No symbols defined.\n";
+            }
+            for (auto& entry : symbols) {
+                const Symbol& symbol = *entry.second;
+                console() << symbol.name << " - " << symbol.members.size() << " shapes, " << symbol.width << "x"
+                    << symbol.height << ", " << symbol.runs.size() << " runs\n";
+            }
             return;
         }
-        bool isFill = false;
-        string color, figure;
-        if (shapeType == "fill") {
-			isFill = true;
-            stream >> color >> figure;
-            if (figure == "circle") {
-                int x, y, radius;
-                if (!(stream >> x >> y >> radius)) {
-                    cout << "Invalid parameters for circle. Use: add circle <centerX> <centerY> <radius> <color>\n";
-                    return;
-                }
-                Circle* circle = new Circle(x, y, radius);
-                circle->setColor(color);
-                circle->setFilled(isFill);
-                if (!circle->fitsOnBoard()) {
-                    cout << "Circle's area exceeds board size. Cannot draw.\n";
-                    delete circle;
-                    return;
-                }
-                if (circle->isInsideBoard() && !shapeExists(circle)) {
-                    shapes[++currentId] = circle;
-                    placedShapes.insert(circle->serialize());
-                    circle->drawShape(board, color);
-                }
-                else {
-                    cout << "Invalid circle placement. Either out of bounds or shape already exists.\n";
-                    delete circle;
-                }
+        if (name.empty()) {
+            console() << "Missing symbol name. Use: symbol define <name> or symbol place <name> <x> <y> [color]\n";
+            return;
+        }
+
+        if (action == "define") {
+            set<int> members = selection;
+            if (members.empty() && selectedId != -1) {
+                members.insert(selectedId);
             }
-            else if (figure == "rectangle") {
-                isFill = true;
-                int x, y, width, height;
-                if (!(stream >> x >> y >> width >> height)) {
-                    cout << "Invalid parameters for rectangle. Use: add rectangle <leftX> <topY> <width> <height>\n";
-                    return;
-                }
-                Rectangle* rectangle = new Rectangle(x, y, width, height);
-                rectangle->setColor(color);
-                if (!rectangle->fitsOnBoard()) {
-                    cout << "Rectangle's area exceeds board size. Cannot draw.\n";
-                    delete rectangle;
-                    return;
-                }
-                if (rectangle->isInsideBoard() && !shapeExists(rectangle)) {
-                    shapes[++currentId] = rectangle;
-                    placedShapes.insert(rectangle->serialize());
-                    rectangle->drawShape(board, color);
-                }
-                else {
-                    cout << "Invalid rectangle placement. Either out of bounds or shape already exists.\n";
-                    delete rectangle;
-                }
+            if (members.empty()) {
+                console() << "No shape is currently selected.\n";
+                return;
             }
-            else if (figure == "triangle") {
-                isFill = true;
-                stream >> triangleType;
-                int x, y, length;
-                if (!(stream >> x >> y >> length) || (triangleType != "right" && triangleType != "equal")) {
-                    cout << "Invalid parameters for triangle. Use: add triangle <type> <leftX> <topY> <length> (type: right/equal)\n";
-                    return;
-                }
-                Triangle* triangle = new Triangle(x, y, length, triangleType);
-                triangle->setColor(color);
-                if (!triangle->fitsOnBoard()) {
-                    cout << "Triangle's area exceeds board size. Cannot draw.\n";
-                    delete triangle;
-                    return;
-                }
-                if (triangle->isInsideBoard() && !shapeExists(triangle)) {
-                    shapes[++currentId] = triangle;
-                    placedShapes.insert(triangle->serialize());
-                    triangle->drawShape(board, color);
-                }
-                else {
-                    cout << "Invalid triangle placement. Either out of bounds or shape already exists.\n";
-                    delete triangle;
-                }
+            if (symbols.count(name)) {
+                console() << "Symbol " << name << " already exists.\n";
+                return;
             }
-
-        }
-        else {
-            if (shapeType == "circle") {
-                int x, y, radius;
-                if (!(stream >> x >> y >> radius)) {
-                    cout << "Invalid parameters for circle. Use: add circle <centerX> <centerY> <radius>\n";
-                    return;
-                }
-                Circle* circle = new Circle(x, y, radius);
-                if (!circle->fitsOnBoard()) {
-                    cout << "Circle's area exceeds board size. Cannot draw.\n";
-                    delete circle;
+            // Members are stored relative to the top-left corner of the group on the board
+            Bounds group = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+            for (int id : members) {
+                if (dynamic_cast<Instance*>(shapes.at(id).get()) != nullptr) {
+                    console() << "Symbols are built from plain shapes; the selection holds an instance.\n";
                     return;
                 }
-                if (circle->isInsideBoard() && !shapeExists(circle)) {
-                    shapes[++currentId] = circle;
-                    placedShapes.insert(circle->serialize());
-                    circle->draw(board);
-                }
-                else {
-                    cout << "Invalid circle placement. Either out of bounds or shape already exists.\n";
-                    delete circle;
-                }
+                Bounds b = shapes.at(id)->bounds();
+                group.left = min(group.left, max(b.left, 0));
+                group.top = min(group.top, max(b.top, 0));
             }
-            else if (shapeType == "rectangle") {
-                int x, y, width, height;
-                if (!(stream >> x >> y >> width >> height)) {
-                    cout << "Invalid parameters for rectangle. Use: add rectangle <leftX> <topY> <width> <height>\n";
-                    return;
-                }
-                Rectangle* rectangle = new Rectangle(x, y, width, height);
-                if (!rectangle->fitsOnBoard()) {
-                    cout << "Rectangle's area exceeds board size. Cannot draw.\n";
-                    delete rectangle;
-                    return;
-                }
-                if (rectangle->isInsideBoard() && !shapeExists(rectangle)) {
-                    shapes[++currentId] = rectangle;
-                    placedShapes.insert(rectangle->serialize());
-                    rectangle->draw(board);
-                }
-                else {
-                    cout << "Invalid rectangle placement. Either out of bounds or shape already exists.\n";
-                    delete rectangle;
-                }
+            vector<string> definition;
+            for (int id : members) {
+                unique_ptr<Shape> member(shapes.at(id)->clone());
+                member->shift(-group.left, -group.top);
+                definition.push_back(member->serialize());
             }
-            else if (shapeType == "triangle") {
-                stream >> triangleType;
-                int x, y, length;
-                if (!(stream >> x >> y >> length) || (triangleType != "right" && triangleType != "equal")) {
-                    cout << "Invalid parameters for triangle. Use: add triangle <type> <leftX> <topY> <length> (type: right/equal)\n";
-                    return;
-                }
-                Triangle* triangle = new Triangle(x, y, length, triangleType);
-                if (!triangle->fitsOnBoard()) {
-                    cout << "Circle's area exceeds board size. Cannot draw.\n";
-                    delete triangle;
-                    return;
-                }
-                if (triangle->isInsideBoard() && !shapeExists(triangle)) {
-                    shapes[++currentId] = triangle;
-                    placedShapes.insert(triangle->serialize());
-                    triangle->draw(board);
-                }
-                else {
-                    cout << "Invalid triangle placement. Either out of bounds or shape already exists.\n";
-                    delete triangle;
-                }
+            addSymbol(buildSymbol(name, definition, symbols));
+            console() << "Symbol " << name << " defined from " << members.size() << " shapes.\n";
+        }
+        else if (action == "place") {
+            int x, y;
+            string color = "none";
+            if (!symbols.count(name) || !(stream >> x >> y)) {
+                console() << "Unknown symbol or missing position. Use: symbol place <name> <x> <y> [color]\n";
+                return;
+            }
+            stream >> color;
+            Instance* instance = new Instance(symbols.at(name), x, y);
+            instance->setColor(color);
+            if (instance->isInsideBoard() && !shapeExists(instance)) {
+                storeShape(instance);
+                renderNew(instance, board);
+                console() << "Placed " << name << " at (" << x << ", " << y << ").\n";
             }
             else {
-                cout << "Unknown shape type. Available shapes are circle, rectangle, triangle.\n";
+                console() << "Invalid instance placement. Either out of bounds or instance already exists.\n";
+                delete instance;
             }
-        }   
+        }
+        else {
+            console() << "Unknown symbol action. Use: symbol define|place|list\n";
+        }
     }
 
-    void drawAllShapes(Board& board) {
-        board.clear();
-        for (auto& pair : shapes) {
-            pair.second->draw(board);
-			if (pair.second->getFilled() == true) {
-				string color = pair.second->getColor();
-				pair.second->drawShape(board, color);
+    // find <term> ...: shapes matching every term, e.g.
+    // find type=circle color=red filled area>100 inside=0,0,30,20
+    void find(const string& input) const {
+        vector<FindTerm> terms;
+        string error;
+        if (!parseFind(input, terms, error)) {
+            console() << error << " Terms: type=<name,...> color=<name,...> filled|frame area<op>N id<op>N "
+                "inside=x,y,w,h touches=x,y,w,h, each optionally negated with !\n";
+            return;
+        }
+        size_t found = table.find(terms, console());
+        console() << (found == 0 ? string("No shapes match.") : to_string(found) + " shapes found.") << "\n";
+    }
+
+    // snapshot <name>: remembers the scene under a name. The maps share their
+    // nodes with the live scene, so this costs O(1) and later edits copy only
+    // the paths they touch.
+    void snapshot(const string& input) {
+        istringstream stream(input);
+        string command, name;
+        stream >> command >> name;
+        if (name.empty()) {
+            if (snapshots.empty()) {
+                console() << "No snapshots taken. Use: snapshot <name>\n";
             }
-            else {
-                pair.second->draw(board);
+            for (auto& entry : snapshots) {
+                console() << entry.first << " - " << entry.second.shapes.size() << " shapes\n";
             }
+            return;
+        }
+        if (name == "current") {
+            console() << "The name current stands for the live scene in diff. Pick another name.\n";
+            return;
         }
+        snapshots[name] = { shapes, shapeLayers, currentId };
+        console() << "Snapshot " << name << " taken with " << shapes.size() << " shapes.\n";
     }
 
-    void listShapes() {
-        if (shapes.empty()) {
-            cout << "No shapes added.\n";
+    // checkout <name>: switches the scene to a snapshot. Only the shapes that
+    // differ between the two versions are re-indexed and re-rendered.
+    void checkout(const string& input, Board& board) {
+        istringstream stream(input);
+        string command, name;
+        stream >> command >> name;
+        auto it = snapshots.find(name);
+        if (it == snapshots.end()) {
+            console() << "Unknown snapshot. Use: checkout <name>\n";
             return;
         }
-        cout << "List of shapes:\n";
-        for (auto& pair : shapes) {
-            cout << "ID: " << pair.first << " - " << pair.second->info() << "\n";
+        const SceneSnapshot& target = it->second;
+        set<int> changed;
+        auto collect = [&changed](int id, const void*, const void*) {
+            changed.insert(id);
+        };
+        shapes.diff(target.shapes, collect);
+        shapeLayers.diff(target.shapeLayers, collect);
+
+        for (int id : changed) {
+            if (shapes.count(id)) {
+                unindex(id, shapes.at(id).get());
+            }
+        }
+        shapes = target.shapes;
+        shapeLayers = target.shapeLayers;
+        currentId = max(currentId, target.currentId);
+        for (int id : changed) {
+            auto entry = shapes.find(id);
+            if (entry == shapes.end()) {
+                record("r", id);
+                continue;
+            }
+            Shape* shape = entry->second.get();
+            const string& name = shapeLayers.at(id);
+            if (findLayer(name) == nullptr) {
+                layers.push_back(Layer(name));
+                recordLayers();
+            }
+            Layer& layer = *findLayer(name);
+            layer.ids.insert(id);
+            damage(layer, shape->bounds());
+            placedShapes.insert(shape->serialize());
+            index.insert(id, shape);
+            table.insert(id, shape);
+            record("u", id);
+            recordPlacement(id);
+        }
+        restoreSelection(selectionState());
+        drawAllShapes(board);
+        console() << "Checked out " << name << ": " << changed.size() << " shapes differ.\n";
+    }
+
+    // diff <a> <b>: shapes added, removed, changed or moved between layers from
+    // snapshot a to snapshot b; current names the live scene
+    void diff(const string& input) const {
+        istringstream stream(input);
+        string command, from, to;
+        stream >> command >> from >> to;
+        SceneSnapshot live = { shapes, shapeLayers, currentId };
+        auto version = [&](const string& name) -> const SceneSnapshot* {
+            auto it = snapshots.find(name);
+            return name == "current" ? &live : it != snapshots.end() ? &it->second : nullptr;
+        };
+        const SceneSnapshot* a = version(from);
+        const SceneSnapshot* b = version(to);
+        if (a == nullptr || b == nullptr) {
+            console() << "Unknown snapshot. Use: diff <a> <b>, where either may be current\n";
+            return;
         }
+        size_t count = 0;
+        a->shapes.diff(b->shapes, [&count](int id, const shared_ptr<Shape>* before, const shared_ptr<Shape>* after) {
+            if (before == nullptr) {
+                console() << "+ " << id << ": " << (*after)->serialize() << "\n";
+            }
+            else if (after == nullptr) {
+                console() << "- " << id << ": " << (*before)->serialize() << "\n";
+            }
+            else if ((*before)->serialize() != (*after)->serialize()) {
+                console() << "~ " << id << ": " << (*before)->serialize() << " -> " << (*after)->serialize() << "\n";
+            }
+            else {
+                return;  // Copied but left as it was
+            }
+            ++count;
+        });
+        a->shapeLayers.diff(b->shapeLayers, [&count](int id, const string* before, const string* after) {
+            if (before != nullptr && after != nullptr) {
+                console() << "~ " << id << ": layer " << *before << " -> " << *after << "\n";
+                ++count;
+            }
+        });
+        console() << (count == 0 ? string("No differences.") : to_string(count) + " differences.") << "\n";
     }
 
-    void saveBoard(const string& input) {
+    void saveBoard(const string& input) const {
         istringstream stream(input);
         string command, filename;
         stream >> command >> filename;
         ofstream file(filename);
         if (!file.is_open()) {
-            cout << "Could not open file for saving.\n";
+            console() << "Could not open file for saving.\n";
             return;
         }
-        for (auto& pair : shapes) {
-            file << pair.second->serialize() << "\n";
+        for (const string& definition : symbolDefinitions()) {
+            file << definition << "\n";
+        }
+        // A single visible base layer keeps the plain one-shape-per-line format
+        bool headers = layers.size() > 1 || !layers[0].visible || layers[0].name != "base";
+        vector<vector<const Shape*>> members = layerMembers();
+        for (size_t k = 0; k < layers.size(); ++k) {
+            if (headers) {
+                file << "layer " << layers[k].name << (layers[k].visible ? "" : " hidden") << "\n";
+            }
+            for (const Shape* shape : members[k]) {
+                file << shape->serialize() << "\n";
+            }
         }
         file.close();
-        cout << "Board saved successfully to " << filename << ".\n";
+        console() << "Board saved successfully to " << filename << ".\n";
     }
 
     bool loadBoard(const string& input, Board& board) {
@@ -577,234 +3939,365 @@ public:
         stream >> command >> filename;
         ifstream file(filename);
         if (!file.is_open()) {
-            cout << "Could not open file for loading.\n";
+            console() << "Could not open file for loading.\n";
             return false;
         }
 
-        vector<Shape*> tempShapes;
-        string line;
+        // "layer <name> [hidden]" lines put the shapes after them into that
+        // layer; a new layer goes just above the one named before it
+        vector<pair<string, Shape*>> tempShapes;
+        string line, layerName = activeLayer;
+        bool layered = false;
         while (getline(file, line)) {
             istringstream lineStream(line);
             string shapeType;
             lineStream >> shapeType;
 
-            bool isFilled;
-            string color;
-
-            if (shapeType == "circle") {
-                int x, y, radius;
-                lineStream >> x >> y >> radius >> color;
-                string fillStatus;
-                lineStream >> fillStatus;
-                isFilled = (fillStatus == "fill");
-
-                Circle* circle = new Circle(x, y, radius);
-
-                if (circle->isInsideBoard()) {
-                    circle->setFilled(isFilled);
-                    circle->setColor(color);
-                    tempShapes.push_back(circle);
-                }
-                else {
-                    cout << "Invalid circle in file. Skipped.\n";
-                    delete circle;
+            if (shapeType == "layer") {
+                string flag;
+                string below = layered ? layerName : "";
+                lineStream >> layerName >> flag;
+                if (findLayer(layerName) == nullptr) {
+                    size_t position = below.empty() ? 0 : findLayer(below) - &layers[0] + 1;
+                    layers.insert(layers.begin() + position, Layer(layerName));
                 }
+                findLayer(layerName)->visible = flag != "hidden";
+                layered = true;
+                continue;
             }
-            else if (shapeType == "rectangle") {
-                int x, y, width, height;
-                lineStream >> x >> y >> width >> height >> color;
-                string fillStatus;
-                lineStream >> fillStatus;
-                isFilled = (fillStatus == "fill");
-
-                Rectangle* rectangle = new Rectangle(x, y, width, height);
-
-                if (rectangle->isInsideBoard()) {
-                    rectangle->setFilled(isFilled);
-                    rectangle->setColor(color);
-                    tempShapes.push_back(rectangle);
+            if (shapeType == "symbol") {
+                shared_ptr<const Symbol> symbol = parseSymbol(line, symbols);
+                if (symbol == nullptr) {
+                    console() << "Invalid symbol in file. Skipped line: " << line << "\n";
                 }
-                else {
-                    cout << "Invalid rectangle in file. Skipped.\n";
-                    delete rectangle;
+                else if (!addSymbol(symbol) && symbols.at(symbol->name)->members != symbol->members) {
+                    console() << "Symbol " << symbol->name << " is already defined differently. Kept the existing one.\n";
                 }
+                continue;
             }
-            else if (shapeType == "triangle") {
-                string triangleType;
-                int x, y, length;
-                lineStream >> triangleType >> x >> y >> length >> color;
-                string fillStatus;
-                lineStream >> fillStatus;
-                isFilled = (fillStatus == "fill");
-
-                Triangle* triangle = new Triangle(x, y, length, triangleType);
-
-                if (triangle->isInsideBoard()) {
-                    triangle->setFilled(isFilled);
-                    triangle->setColor(color);
-                    tempShapes.push_back(triangle);
-                }
-                else {
-                    cout << "Invalid triangle in file. Skipped.\n";
-                    delete triangle;
-                }
+            Shape* shape = parseShape(line, symbols);
+            if (shape == nullptr) {
+                console() << "Unknown shape type in file. Skipped line: " << line << "\n";
+            }
+            else if (shape->isInsideBoard()) {
+                tempShapes.push_back(make_pair(layerName, shape));
             }
             else {
-                cout << "Unknown shape type in file. Skipped line: " << line << "\n";
+                console() << "Invalid " << shapeType << " in file. Skipped.\n";
+                delete shape;
             }
         }
         file.close();
 
 
-        for (auto& shape : tempShapes) {
-            shapes[++currentId] = shape;
-            placedShapes.insert(shape->serialize());
-			string color = shape->getColor();
-            if (shape->getFilled() == true) {
-                shape->drawShape(board, color);
-            }
-            else {
-                shape->draw(board);
-            }
+        if (layered) {
+            recordLayers();
+        }
+        string active = activeLayer;
+        for (auto& entry : tempShapes) {
+            activeLayer = entry.first;
+            storeShape(entry.second);
+            findLayer(activeLayer)->dirty = true;
         }
+        activeLayer = active;
+        drawAllShapes(board);
 
-        cout << "Board loaded successfully from " << filename << ".\n";
+        console() << "Board loaded successfully from " << filename << ".\n";
         return true;
     }
 
     void clearShapes() {
-        for (auto& pair : shapes) {
-            delete pair.second;
-        }
         shapes.clear();
+        shapeLayers.clear();
         currentId = 0;
         placedShapes.clear();
+        selection.clear();
+        selectedId = -1;
+        index.clear();
+        table.clear();
+        for (auto& layer : layers) {
+            layer.ids.clear();
+            layer.dirty = true;
+        }
     }
 
     void undo(Board& board) {
         if (!shapes.empty()) {
-            shapes.erase(--shapes.end());
+            discardShape(shapes.back().first);
             drawAllShapes(board);
         }
         else {
-            cout << "No shapes to undo.\n";
+            console() << "No shapes to undo.\n";
         }
     }
 
-    void shapesAvalible() {
-        cout << "Available shapes and parameters:\n";
-        cout << "1. Circle: add circle <centerX> <centerY> <radius>\n";
-        cout << "2. Rectangle: add rectangle <leftX> <topY> <width> <height>\n";
-        cout << "3. Triangle (Right): add triangle right <leftX> <topY> <length>\n";
-        cout << "4. Triangle (Equilateral): add triangle equal <centerX> <topY> <length>\n";
-        cout << "5. Circle fill: add circle fill <color> <centerX> <centerY> <redius>\n";
-        cout << "6. Triangle fill: add triangle shape right/equal fill <color> <leftX> <topY> <width> <height>\n";
-        cout << "7. Rectangle fill: add rectangle fill <color> <leftX> <topY> <width> <height>\n";
+    void shapesAvalible() const {
+        console() << "Available shapes and parameters:\n";
+        console() << "1. Circle: add circle <centerX> <centerY> <radius>\n";
+        console() << "2. Rectangle: add rectangle <leftX> <topY> <width> <height>\n";
+        console() << "3. Triangle (Right): add triangle right <leftX> <topY> <length>\n";
+        console() << "4. Triangle (Equilateral): add triangle equal <centerX> <topY> <length>\n";
+        console() << "5. Circle fill: add circle fill <color> <centerX> <centerY> <redius>\n";
+        console() << "6. Triangle fill: add triangle shape right/equal fill <color> <leftX> <topY> <width> <height>\n";
+        console() << "7. Rectangle fill: add rectangle fill <color> <leftX> <topY> <width> <height>\n";
+        console() << "Filled shapes take an optional opacity percent after their size, e.g. add fill red circle 10 10 5 50\n";
+        console() << "Symbols: symbol define <name> stores the selection once, symbol place <name> <x> <y> [color] reuses it\n";
+        console() << "Snapshots: snapshot <name> keeps the scene, checkout <name> returns to it, diff <a> <b> compares (current is the live scene)\n";
+        console() << "Tracing: trace start records timed spans, trace stop <file> writes them as Chrome trace-event JSON\n";
+    }
+
+    SelectionState selectionState() const {
+        return { selectedId, selection };
+    }
+
+    // Adopts a selection made elsewhere, dropping shapes that no longer exist
+    void restoreSelection(const SelectionState& state) {
+        selectedId = shapes.count(state.selectedId) ? state.selectedId : -1;
+        selection.clear();
+        for (int id : state.group) {
+            if (shapes.count(id)) {
+                selection.insert(id);
+            }
+        }
     }
 
     void select(const string& input) {
+        SelectionState state = selectionState();
+        pick(input, state);
+        restoreSelection(state);
+    }
+
+    // Resolves a select command against the scene without changing it
+    void pick(const string& input, SelectionState& state) const {
         istringstream stream(input);
         string command, arg1, arg2;
         stream >> command >> arg1 >> arg2;
 
+        if (arg1 == "rect") {
+            selectRect(input, state);
+            return;
+        }
+        if (arg1 == "color") {
+            selectColor(arg2, state);
+            return;
+        }
+        state.group.clear();
+
         if (arg2.empty()) {
             int id;
             if (stringstream(arg1) >> id) {
                 auto it = shapes.find(id);
                 if (it != shapes.end()) {
-                    cout << "Selected shape: " << it->second->info() << "\n";
-                    selectedId = id;
+                    console() << "Selected shape: " << it->second->info() << "\n";
+                    state.selectedId = id;
                 }
                 else {
-                    cout << "Shape with ID " << id << " not found.\n";
+                    console() << "Shape with ID " << id << " not found.\n";
                 }
             }
             else {
-                cout << "Invalid shape ID.\n";
+                console() << "Invalid shape ID.\n";
             }
         }
         else {
             int x, y;
             if (stringstream(arg1) >> x && stringstream(arg2) >> y) {
-                if (x < 0 || x >= BOARD_WIDTH || y < 0 || y >= BOARD_HEIGHT) {
-                    cout << "Coordinates (" << x << ", " << y << ") are out of the board's boundaries.\n";
+                if (x < 0 || x >= canvasWidth || y < 0 || y >= canvasHeight) {
+                    console() << "Coordinates (" << x << ", " << y << ") are out of the board's boundaries.\n";
                     return;
                 }
 
                 bool found = false;
                 for (auto& pair : shapes) {
-                    Shape* shape = pair.second;
+                    Shape* shape = pair.second.get();
 
                     Board tempBoard;
                     shape->draw(tempBoard);
 
                     if (tempBoard.grid[y][x] != ' ') {
-                        cout << "Shape at (" << x << ", " << y << "): " << shape->info() << "\n";
-                        selectedId = pair.first;
+                        console() << "Shape at (" << x << ", " << y << "): " << shape->info() << "\n";
+                        state.selectedId = pair.first;
                         found = true;
                         break;
                     }
                 }
 
-                if (!found) {
-                    cout << "No shape found at (" << x << ", " << y << ").\n";
+                if (!found) {
+                    console() << "No shape found at (" << x << ", " << y << ").\n";
+                }
+            }
+            else {
+                console() << "Invalid coordinates. Use: select <ID> or select <x> <y>\n";
+            }
+        }
+    }
+
+    void selectRect(const string& input, SelectionState& state) const {
+        istringstream stream(input);
+        string command, mode;
+        int x0, y0, x1, y1;
+        if (!(stream >> command >> mode >> x0 >> y0 >> x1 >> y1)) {
+            console() << "Invalid region. Use: select rect <x0> <y0> <x1> <y1>\n";
+            return;
+        }
+        Bounds area = { min(x0, x1), min(y0, y1), max(x0, x1), max(y0, y1) };
+        state.group.clear();
+        if (indexed) {
+            vector<int> found = index.query(area);
+            state.group.insert(found.begin(), found.end());
+        }
+        else {
+            for (auto& entry : shapes) {
+                if (entry.second->bounds().intersects(area)) {
+                    state.group.insert(state.group.end(), entry.first);
                 }
             }
-            else {
-                cout << "Invalid coordinates. Use: select <ID> or select <x> <y>\n";
+        }
+        state.selectedId = -1;
+        console() << "Selected " << state.group.size() << " shapes in region (" << area.left << ", " << area.top
+            << ") - (" << area.right << ", " << area.bottom << ").\n";
+    }
+
+    void selectColor(const string& color, SelectionState& state) const {
+        if (color.empty()) {
+            console() << "Invalid color. Use: select color <color>\n";
+            return;
+        }
+        state.group.clear();
+        if (indexed) {
+            vector<int> found = index.withColor(color);
+            state.group.insert(found.begin(), found.end());
+        }
+        else {
+            for (auto& entry : shapes) {
+                if (entry.second->getColor() == color) {
+                    state.group.insert(state.group.end(), entry.first);
+                }
             }
         }
+        state.selectedId = -1;
+        console() << "Selected " << state.group.size() << " shapes with color " << color << ".\n";
     }
 
-    void removeShape(Board& board) {
+    // Applies one offset to every shape in the group; the caller redraws once
+    void shiftSelection(int dx, int dy) {
+        for (int id : selection) {
+            Shape* shape = editable(id);
+            string before = shape->serialize();
+            shape->shift(dx, dy);
+            shapeChanged(id, before);
+        }
+    }
+
+    void shiftShapes(const string& input, Board& board) {
+        istringstream stream(input);
+        string command;
+        int dx, dy;
+        if (!(stream >> command >> dx >> dy)) {
+            console() << "Invalid offset. Use: shift <dx> <dy>\n";
+            return;
+        }
+
+        if (!selection.empty()) {
+            shiftSelection(dx, dy);
+            drawAllShapes(board);
+            console() << selection.size() << " shapes shifted by (" << dx << ", " << dy << ").\n";
+            return;
+        }
         if (selectedId == -1) {
-            cout << "No shape is currently selected.\n";
+            console() << "No shape is currently selected.\n";
             return;
         }
 
         auto it = shapes.find(selectedId);
         if (it != shapes.end()) {
-            placedShapes.erase(it->second->serialize());
-            delete it->second;
-            shapes.erase(it);
-            selectedId = -1;  // Reset the last selected ID
+            Shape* shape = editable(selectedId);
+            string before = shape->serialize();
+            shape->shift(dx, dy);
+            shapeChanged(selectedId, before);
             drawAllShapes(board);
-            cout << "Shape removed from the board.\n";
+            console() << "Shape with ID " << selectedId << " shifted by (" << dx << ", " << dy << ").\n";
         }
         else {
-            cout << "Shape not found.\n";
+            console() << "Shape not found.\n";
         }
     }
 
-    void moveShape(const string& input, Board& board) {
+    void removeShape(Board& board) {
+        if (!selection.empty()) {
+            size_t count = selection.size();
+            set<int> group = selection;
+            for (int id : group) {
+                discardShape(id);
+            }
+            drawAllShapes(board);
+            console() << count << " shapes removed from the board.\n";
+            return;
+        }
         if (selectedId == -1) {
-            cout << "No shape is currently selected.\n";
+            console() << "No shape is currently selected.\n";
             return;
         }
 
+        auto it = shapes.find(selectedId);
+        if (it != shapes.end()) {
+            discardShape(selectedId);  // Also resets the last selected ID
+            drawAllShapes(board);
+            console() << "Shape removed from the board.\n";
+        }
+        else {
+            console() << "Shape not found.\n";
+        }
+    }
+
+    void moveShape(const string& input, Board& board) {
         istringstream stream(input);
         string command;
         int newX, newY;
-        stream >> command >> newX >> newY;
+        if (!(stream >> command >> newX >> newY)) {
+            console() << "Invalid position. Use: move <x> <y>\n";
+            return;
+        }
+
+        if (!selection.empty()) {
+            // The group keeps its layout; its top-left corner lands on (newX, newY)
+            Bounds group = shapes.at(*selection.begin())->bounds();
+            for (int id : selection) {
+                Bounds b = shapes.at(id)->bounds();
+                group.left = min(group.left, b.left);
+                group.top = min(group.top, b.top);
+            }
+            shiftSelection(newX - group.left, newY - group.top);
+            drawAllShapes(board);
+            console() << selection.size() << " shapes moved to (" << newX << ", " << newY << ").\n";
+            return;
+        }
+        if (selectedId == -1) {
+            console() << "No shape is currently selected.\n";
+            return;
+        }
 
         auto it = shapes.find(selectedId);
         if (it != shapes.end()) {
-            Shape* shape = it->second;
+            Shape* shape = editable(selectedId);
+            string before = shape->serialize();
             shape->move(newX, newY);
+            shapeChanged(selectedId, before);
             drawAllShapes(board);
             string originalColor = shape->getColor();
             bool wasFilled = shape->getFilled();
 
-            cout << "Shape with ID " << selectedId << " moved to (" << newX << ", " << newY << ").\n";
+            console() << "Shape with ID " << selectedId << " moved to (" << newX << ", " << newY << ").\n";
         }
         else {
-            cout << "Shape not found.\n";
+            console() << "Shape not found.\n";
         }
     }
 
     void editShape(const string& input, Board& board) {
+        TRACE_SCOPE("editShape");
         if (selectedId == -1) {
-            cout << "No shape is currently selected.\n";
+            console() << "No shape is currently selected.\n";
             return;
         }
 
@@ -819,21 +4312,22 @@ public:
         }
 
         if (newParams.empty()) {
-            cout << "Error: No parameters provided for editing.\n";
+            console() << "Error: No parameters provided for editing.\n";
             return;
         }
 
         auto it = shapes.find(selectedId);
         if (it == shapes.end()) {
-            cout << "Shape not found.\n";
+            console() << "Shape not found.\n";
             return;
         }
 
-        Shape* shape = it->second;
+        // Validate against the shared shape; only an applied edit clones it
+        const Shape* shape = it->second.get();
         string originalColor = shape->getColor();
         bool wasFilled = shape->getFilled();
 
-        if (Circle* circle = dynamic_cast<Circle*>(shape)) {
+        if (const Circle* circle = dynamic_cast<const Circle*>(shape)) {
             if (newParams.size() == 1) {
                 vector<int> newRadius = { newParams[0] };
                 Circle tempCircle = *circle;
@@ -841,19 +4335,21 @@ public:
                 string originalColor = shape->getColor();
                 bool wasFilled = shape->getFilled();
                 if (tempCircle.isInsideBoard()) {
-                    circle->applyEdit(newRadius);
+                    string before = shape->serialize();
+                    static_cast<Circle*>(editable(selectedId))->applyEdit(newRadius);
+                    shapeChanged(selectedId, before);
                     drawAllShapes(board);
-                    cout << "Circle radius changed to " << newRadius[0] << ".\n";
+                    console() << "Circle radius changed to " << newRadius[0] << ".\n";
                 }
                 else {
-                    cout << "Error: shape will go out of the board.\n";
+                    console() << "Error: shape will go out of the board.\n";
                 }
             }
             else {
-                cout << "Error: invalid argument count for circle. Expected: edit <newRadius>\n";
+                console() << "Error: invalid argument count for circle. Expected: edit <newRadius>\n";
             }
         }
-        else if (Rectangle* rectangle = dynamic_cast<Rectangle*>(shape)) {
+        else if (const Rectangle* rectangle = dynamic_cast<const Rectangle*>(shape)) {
             if (newParams.size() == 2) {
                 vector<int> newDimensions = { newParams[0], newParams[1] };
                 Rectangle tempRectangle = *rectangle;
@@ -861,19 +4357,21 @@ public:
                 string originalColor = shape->getColor();
                 bool wasFilled = shape->getFilled();
                 if (tempRectangle.isInsideBoard()) {
-                    rectangle->applyEdit(newDimensions);
+                    string before = shape->serialize();
+                    static_cast<Rectangle*>(editable(selectedId))->applyEdit(newDimensions);
+                    shapeChanged(selectedId, before);
                     drawAllShapes(board);
-                    cout << "Rectangle size changed to " << newDimensions[0] << "x" << newDimensions[1] << ".\n";
+                    console() << "Rectangle size changed to " << newDimensions[0] << "x" << newDimensions[1] << ".\n";
                 }
                 else {
-                    cout << "Error: shape will go out of the board.\n";
+                    console() << "Error: shape will go out of the board.\n";
                 }
             }
             else {
-                cout << "Error: invalid argument count for rectangle. Expected: edit <newWidth> <newHeight>\n";
+                console() << "Error: invalid argument count for rectangle. Expected: edit <newWidth> <newHeight>\n";
             }
         }
-        else if (Triangle* triangle = dynamic_cast<Triangle*>(shape)) {
+        else if (const Triangle* triangle = dynamic_cast<const Triangle*>(shape)) {
             if (newParams.size() == 1) {
                 vector<int> newLength = { newParams[0] };
                 Triangle tempTriangle = *triangle;
@@ -881,106 +4379,781 @@ public:
                 string originalColor = shape->getColor();
                 bool wasFilled = shape->getFilled();
                 if (tempTriangle.isInsideBoard()) {
-                    triangle->applyEdit(newLength);
+                    string before = shape->serialize();
+                    static_cast<Triangle*>(editable(selectedId))->applyEdit(newLength);
+                    shapeChanged(selectedId, before);
                     drawAllShapes(board);
-                    cout << "Triangle length changed to " << newLength[0] << ".\n";
+                    console() << "Triangle length changed to " << newLength[0] << ".\n";
                 }
                 else {
-                    cout << "Error: shape will go out of the board.\n";
+                    console() << "Error: shape will go out of the board.\n";
                 }
             }
             else {
-                cout << "Error: invalid argument count for triangle. Expected: edit <newLength>\n";
+                console() << "Error: invalid argument count for triangle. Expected: edit <newLength>\n";
             }
         }
         else {
-            cout << "Error: Unsupported shape type for editing.\n";
+            console() << "Error: Unsupported shape type for editing.\n";
         }
     }
     
     void paint(const string& input, Board& board) {
-        if (selectedId == -1) {
-            cout << "No shape is currently selected.\n";
-            return;
-        }
-
         istringstream stream(input);
         string command, color;
         stream >> command >> color;
 
+        if (!selection.empty()) {
+            for (int id : selection) {
+                Shape* shape = editable(id);
+                string before = shape->serialize();
+                shape->setColor(color);
+                shapeChanged(id, before);
+            }
+            drawAllShapes(board);
+            console() << selection.size() << " shapes color changed to " << color << ".\n";
+            return;
+        }
+        if (selectedId == -1) {
+            console() << "No shape is currently selected.\n";
+            return;
+        }
+
         auto it = shapes.find(selectedId);
         if (it != shapes.end()) {
-            it->second->setColor(color);
+            Shape* shape = editable(selectedId);
+            string before = shape->serialize();
+            shape->setColor(color);
+            shapeChanged(selectedId, before);
 
             board.clear();
             drawAllShapes(board);
 
-            cout << "Shape with ID " << selectedId << " color changed to " << color << ".\n";
+            console() << "Shape with ID " << selectedId << " color changed to " << color << ".\n";
         }
         else {
-            cout << "Shape not found.\n";
+            console() << "Shape not found.\n";
+        }
+    }
+
+};
+
+// Runs one line of the command grammar. `present` shows the board afterwards
+// and is told whether the board was blanked instead of redrawn.
+bool runCommand(const string& command, Commands& c, Board& board, const function<void(bool)>& present) {
+    if (command == "exit") {
+        return false;
+    }
+    else if (command.find("trace") == 0) {
+        traceCommand(command);
+    }
+    else if (command == "draw") {
+        c.drawAllShapes(board);
+        present(false);
+    }
+    else if (command == "shapes") {
+        c.shapesAvalible();
+    }
+    else if (command == "list") {
+        c.listShapes();
+    }
+    else if (command == "coverage") {
+        c.coverage();
+    }
+    else if (command.find("find") == 0) {
+        c.find(command);
+    }
+    else if (command.find("diff") == 0) {
+        c.diff(command);
+    }
+    else if (command == "undo") {
+        c.undo(board);
+        present(false);
+    }
+    else if (command.find("save") == 0) {
+        c.saveBoard(command);
+    }
+    else if (command.find("load") == 0) {
+        c.loadBoard(command, board);
+        present(false);
+    }
+    else if (command == "clear") {
+        board.clear();
+        present(true);
+    }
+    else if (command.find("select") == 0) {
+        c.select(command);
+    }
+    else if (command.find("move") == 0) {
+        c.moveShape(command, board);
+        present(false);
+    }
+    else if (command.find("export") == 0) {
+        c.exportImage(command, board);
+    }
+    else if (command.find("mode") == 0) {
+        c.setMode(command, board);
+        present(false);
+    }
+    else if (command.find("view") == 0) {
+        c.setView(command, board);
+        present(false);
+    }
+    else if (command.find("pan") == 0) {
+        c.pan(command, board);
+        present(false);
+    }
+    else if (command.find("zoom") == 0) {
+        c.zoom(command, board);
+        present(false);
+    }
+    else if (command.find("shift") == 0) {
+        c.shiftShapes(command, board);
+        present(false);
+    }
+    else if (command == "remove") {
+        c.removeShape(board);
+    }
+    else if (command.find("edit") == 0) {
+        c.editShape(command, board);
+        present(false);
+    }
+    else if (command.find("paint") == 0) {
+        c.paint(command, board);
+    }
+    else if (command.find("layer") == 0) {
+        c.layer(command, board);
+        present(false);
+    }
+    else if (command.find("symbol") == 0) {
+        c.symbol(command, board);
+        present(false);
+    }
+    else if (command.find("snapshot") == 0) {
+        c.snapshot(command);
+    }
+    else if (command.find("checkout") == 0) {
+        c.checkout(command, board);
+        present(false);
+    }
+    else {
+        c.addShape(command, board);
+        present(false);
+    }
+    return true;
+}
+
+// Commands that only read the scene; the server runs them on snapshots
+bool isQuery(const string& command) {
+    return command == "list" || command == "shapes" || command == "draw" || command == "coverage" ||
+        command.find("find") == 0 || command.find("diff") == 0 || command.find("select") == 0 || command.find("save") == 0 || command.find("export") == 0;
+}
+
+void runQuery(const string& command, const Commands& scene, SelectionState& selection) {
+    if (command == "list") {
+        scene.listShapes();
+    }
+    else if (command == "shapes") {
+        scene.shapesAvalible();
+    }
+    else if (command == "draw") {
+        Board board;
+        scene.rasterize(board);
+        board.print();
+    }
+    else if (command == "coverage") {
+        scene.coverage();
+    }
+    else if (command.find("find") == 0) {
+        scene.find(command);
+    }
+    else if (command.find("diff") == 0) {
+        scene.diff(command);
+    }
+    else if (command.find("select") == 0) {
+        scene.pick(command, selection);
+    }
+    else if (command.find("save") == 0) {
+        scene.saveBoard(command);
+    }
+    else if (command.find("export") == 0) {
+        Board board;
+        scene.exportImage(command, board);
+    }
+}
+
+// Swallows output so replays measure the whole path without a terminal
+class DiscardBuffer : public streambuf {
+protected:
+    int overflow(int c) override {
+        return c;
+    }
+
+    streamsize xsputn(const char*, streamsize count) override {
+        return count;
+    }
+};
+
+// FNV-1a over glyphs and colors, to tell whether two runs drew the same board
+uint64_t boardHash(const Board& board) {
+    uint64_t hash = 14695981039346656037ULL;
+    auto mix = [&hash](unsigned char byte) {
+        hash ^= byte;
+        hash *= 1099511628211ULL;
+    };
+    for (int i = 0; i < board.view.height; ++i) {
+        for (int j = 0; j < board.view.width; ++j) {
+            mix((unsigned char)board.grid[i][j]);
+            for (char c : board.colorGrid[i][j]) {
+                mix((unsigned char)c);
+            }
+            mix(0);
+        }
+    }
+    return hash;
+}
+
+// Differential fuzzing: random command sequences go through one scene using
+// the optimized engine (culling, spans, viewport mapping) and one using the
+// reference engine, and both boards must match after every step
+class FuzzHarness {
+    mt19937 rng;
+    const vector<string>& sceneFiles;
+
+    int pick(int low, int high) {
+        return uniform_int_distribution<int>(low, high)(rng);
+    }
+
+public:
+    FuzzHarness(unsigned seed, const vector<string>& files) : rng(seed), sceneFiles(files) {}
+
+    string randomShape() {
+        static const char* colors[] = { "red", "green", "yellow", "blue", "purple", "white", "none" };
+        string fill = pick(0, 1) ? string("fill ") + colors[pick(0, 6)] + " " : "";
+        // Coordinates and sizes reach past the board edges on purpose
+        string at = to_string(pick(-8, canvasWidth + 8)) + " " + to_string(pick(-8, canvasHeight + 8));
+        switch (pick(0, 2)) {
+        case 0:
+            return "add " + fill + "circle " + at + " " + to_string(pick(0, 14));
+        case 1:
+            return "add " + fill + "rectangle " + at + " " + to_string(pick(-1, 30)) + " " + to_string(pick(-1, 20));
+        default:
+            return "add " + fill + "triangle " + (pick(0, 1) ? "right " : "equal ") + at + " " + to_string(pick(-1, 16));
+        }
+    }
+
+    string randomCommand() {
+        static const char* colors[] = { "red", "green", "yellow", "blue", "purple", "white" };
+        int x = pick(-10, canvasWidth + 10), y = pick(-10, canvasHeight + 10);
+        switch (pick(0, 17)) {
+        case 0: case 1: case 2: case 3: case 4:
+            return randomShape();
+        case 5:
+            return "select " + to_string(pick(1, 12));
+        case 6:
+            return "select " + to_string(pick(0, canvasWidth - 1)) + " " + to_string(pick(0, canvasHeight - 1));
+        case 7:
+            return pick(0, 1) ? "select rect " + to_string(x) + " " + to_string(y) + " " + to_string(pick(-10, 70)) + " " +
+                to_string(pick(-10, 50)) : string("select color ") + colors[pick(0, 5)];
+        case 8:
+            return "move " + to_string(x) + " " + to_string(y);
+        case 9:
+            return "shift " + to_string(pick(-6, 6)) + " " + to_string(pick(-6, 6));
+        case 10:
+            return "edit " + to_string(pick(-1, 15)) + (pick(0, 1) ? " " + to_string(pick(-1, 15)) : "");
+        case 11:
+            return string("paint ") + colors[pick(0, 5)];
+        case 12:
+            return pick(0, 1) ? "remove" : "undo";
+        case 13:
+            return "load " + sceneFiles[pick(0, (int)sceneFiles.size() - 1)];
+        case 14:
+            return pick(0, 1) ? "view " + to_string(x) + " " + to_string(y) + " " + to_string(pick(1, 70)) + " " +
+                to_string(pick(1, 45)) : string("view reset");
+        case 15:
+            return pick(0, 2) == 0 ? "pan " + to_string(pick(-9, 9)) + " " + to_string(pick(-9, 9)) :
+                string("zoom ") + (pick(0, 1) ? "out" : "in");
+        case 16: {
+            if (pick(0, 3) == 0) {
+                return (pick(0, 1) ? "snapshot v" : "checkout v") + to_string(pick(0, 2));
+            }
+            if (pick(0, 2) == 0) {
+                return pick(0, 1) ? "symbol define s" + to_string(pick(0, 1)) :
+                    "symbol place s" + to_string(pick(0, 1)) + " " + to_string(x) + " " + to_string(y);
+            }
+            static const char* actions[] = { "add", "use", "hide", "show", "up", "down", "put", "remove" };
+            static const char* names[] = { "base", "back", "front" };
+            return string("layer ") + actions[pick(0, 7)] + " " + names[pick(0, 2)];
+        }
+        default:
+            return pick(0, 1) ? "draw" : "clear";
+        }
+    }
+
+    static bool sameBoard(const Board& a, const Board& b) {
+        return a.grid == b.grid && a.colorGrid == b.colorGrid;
+    }
+
+    vector<string> randomCase() {
+        vector<string> commands(pick(1, 12));
+        for (auto& command : commands) {
+            command = randomCommand();
+        }
+        return commands;
+    }
+
+    // Number of steps that ran identically; equals the size when nothing diverged
+    static size_t matchingSteps(const vector<string>& commands) {
+        Commands optimized, reference;
+        reference.setReferenceEngine(true);
+        Board a, b;
+        auto nothing = [](bool) {};
+        for (size_t i = 0; i < commands.size(); ++i) {
+            runCommand(commands[i], optimized, a, nothing);
+            runCommand(commands[i], reference, b, nothing);
+            if (!sameBoard(a, b)) {
+                return i;
+            }
         }
+        optimized.drawAllShapes(a);
+        reference.drawAllShapes(b);
+        return sameBoard(a, b) ? commands.size() : commands.size() - 1;
     }
 
+    // Drops commands one at a time for as long as the case still fails
+    static vector<string> shrink(vector<string> commands) {
+        commands.resize(matchingSteps(commands) + 1);
+        bool smaller = true;
+        while (smaller) {
+            smaller = false;
+            for (size_t i = 0; i < commands.size(); ++i) {
+                vector<string> candidate = commands;
+                candidate.erase(candidate.begin() + i);
+                if (!candidate.empty() && matchingSteps(candidate) < candidate.size()) {
+                    commands = candidate;
+                    smaller = true;
+                    break;
+                }
+            }
+        }
+        return commands;
+    }
 };
 
-int main() {
+int runFuzz(long long cases, unsigned seed) {
+    // Small scenes for the load command, plus lines reaching off the board
+    vector<string> sceneFiles;
+    {
+        DiscardBuffer discardBuffer;
+        ostream discard(&discardBuffer);
+        consoleOutput = &discard;
+        FuzzHarness generator(seed, sceneFiles);
+        for (int k = 0; k < 3; ++k) {
+            string name = "fuzz-scene-" + to_string(k) + ".txt";
+            Commands scene;
+            Board scratch;
+            for (int n = 0; n < 6; ++n) {
+                scene.addShape(generator.randomShape(), scratch);
+            }
+            scene.saveBoard("save " + name);
+            ofstream(name, ios::app) << "rectangle 50 35 20 10 blue filled\ncircle 70 5 3 red filled\n";
+            sceneFiles.push_back(name);
+        }
+        consoleOutput = &cout;
+    }
+
+    atomic<long long> next{ 0 }, steps{ 0 };
+    atomic<bool> failed{ false };
+    mutex failureMutex;
+    vector<string> failure;
+    auto start = chrono::steady_clock::now();
+
+    auto worker = [&](unsigned workerSeed) {
+        DiscardBuffer discardBuffer;
+        ostream discard(&discardBuffer);
+        consoleOutput = &discard;
+        FuzzHarness harness(workerSeed, sceneFiles);
+        while (!failed.load(memory_order_relaxed) && next.fetch_add(1, memory_order_relaxed) < cases) {
+            vector<string> commands = harness.randomCase();
+            steps.fetch_add((long long)commands.size(), memory_order_relaxed);
+            if (FuzzHarness::matchingSteps(commands) < commands.size() && !failed.exchange(true)) {
+                lock_guard<mutex> lock(failureMutex);
+                failure = FuzzHarness::shrink(commands);
+            }
+        }
+    };
+    vector<thread> workers;
+    unsigned count = max(1u, thread::hardware_concurrency());
+    for (unsigned i = 0; i < count; ++i) {
+        workers.emplace_back(worker, seed * 7919u + i);
+    }
+    for (auto& t : workers) {
+        t.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    for (const string& name : sceneFiles) {
+        remove(name.c_str());
+    }
+
+    long long checked = min(next.load(), cases);
+    cout << "Checked " << checked << " cases (" << steps.load() << " steps) in " << seconds << " s, "
+        << (long long)(checked / max(seconds, 1e-9) * 60) << " cases per minute on " << count << " threads.\n";
+    if (!failed.load()) {
+        cout << "Optimized and reference engines drew identical boards.\n";
+        return 0;
+    }
+    cout << "Boards differ after the last command of this minimal case (seed " << seed << "):\n";
+    for (const string& command : failure) {
+        cout << "  " << command << "\n";
+    }
+    return 1;
+}
+
+// Feeds a recorded trace ("<ms>\t<command>" per line) through the normal
+// command path, as fast as possible or at the recorded pace, and reports the
+// latency of each command type and a hash of the final board
+int replayTrace(const string& path, bool paced) {
+    ifstream trace(path);
+    if (!trace.is_open()) {
+        cout << "Could not open trace " << path << ".\n";
+        return 1;
+    }
+
+    // The header of a recorded trace gives the canvas it ran on
+    string line;
+    if (trace.peek() == '#' && getline(trace, line) && line.find("# canvas ") == 0 && !setCanvasSize(line.substr(9))) {
+        cout << "Invalid canvas size in trace " << path << ".\n";
+        return 1;
+    }
+
+    DiscardBuffer discardBuffer;
+    ostream discard(&discardBuffer);
     Board board;
     Commands c;
-    string command;
+    map<string, vector<double>> latencies;  // Microseconds per command type
+    auto present = [&board](bool) { board.print(); };
 
-    while (true) {
-        cout << "Enter a command: ";
-        getline(cin, command);
-        if (command == "exit") {
+    consoleOutput = &discard;
+    auto start = chrono::steady_clock::now();
+    size_t replayed = 0;
+    while (getline(trace, line)) {
+        size_t tab = line.find('\t');
+        if (tab == string::npos) {
+            continue;
+        }
+        string command = line.substr(tab + 1);
+        if (paced) {
+            this_thread::sleep_until(start + chrono::milliseconds(atoll(line.substr(0, tab).c_str())));
+        }
+
+        auto before = chrono::steady_clock::now();
+        bool running = runCommand(command, c, board, present);
+        auto after = chrono::steady_clock::now();
+        latencies[command.substr(0, command.find(' '))].push_back(
+            chrono::duration<double, micro>(after - before).count());
+        ++replayed;
+        if (!running) {
             break;
         }
-        else if (command == "draw") {
-            c.drawAllShapes(board);
-            board.print();
+    }
+    double total = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    consoleOutput = &cout;
+
+    c.drawAllShapes(board);
+    cout << "Replayed " << replayed << " commands from " << path << " in " << total << " ms.\n";
+    cout << "command      count    p50 us    p90 us    p99 us    max us\n";
+    for (auto& entry : latencies) {
+        vector<double>& times = entry.second;
+        sort(times.begin(), times.end());
+        auto percentile = [&times](int p) { return times[min(times.size() - 1, times.size() * p / 100)]; };
+        cout << entry.first << string(max(1, 12 - (int)entry.first.size()), ' ');
+        char row[96];
+        snprintf(row, sizeof(row), "%5zu %9.1f %9.1f %9.1f %9.1f\n", times.size(),
+            percentile(50), percentile(90), percentile(99), times.back());
+        cout << row;
+    }
+    char hash[32];
+    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)boardHash(board));
+    cout << "Board hash: " << hash << "\n";
+    return 0;
+}
+
+#ifndef _WIN32
+// Serves the command grammar to local clients over a Unix domain socket.
+// Queries run on each client's thread against the latest published snapshot
+// and never take a lock; mutations go through one writer thread that owns the
+// live scene and publishes a new copy-on-write snapshot after each of them.
+class SceneServer {
+    struct Mutation {
+        string command;
+        SelectionState selection;
+        string reply;
+        bool done;
+    };
+
+    Commands live;  // Only touched by the writer thread
+    OperationLog* journal;
+    Board board;    // Writer's board for commands that take one
+    // Read-only view of the latest version, read and replaced with
+    // atomic_load/atomic_store. It shares the maps and find columns with
+    // live, so publishing one costs the same for any scene size and
+    // queries never wait for the writer.
+    shared_ptr<const Commands> published;
+    mutex queueMutex;
+    condition_variable queued, applied;
+    deque<Mutation*> pending;
+
+    void writer() {
+        live.setDeferredRendering(true);
+        while (true) {
+            Mutation* next;
+            {
+                unique_lock<mutex> lock(queueMutex);
+                queued.wait(lock, [this] { return !pending.empty(); });
+                next = pending.front();
+                pending.pop_front();
+            }
+
+            ostringstream reply;
+            consoleOutput = &reply;
+            live.restoreSelection(next->selection);
+            runCommand(next->command, live, board, [](bool) {});
+            live.flushLog();
+            next->selection = live.selectionState();
+            atomic_store(&published, shared_ptr<const Commands>(make_shared<Commands>(live.version())));
+            consoleOutput = &cout;
+
+            {
+                lock_guard<mutex> lock(queueMutex);
+                next->reply = reply.str();
+                next->done = true;
+            }
+            applied.notify_all();
+        }
+    }
+
+    string mutate(const string& command, SelectionState& selection) {
+        Mutation mutation = { command, selection, "", false };
+        unique_lock<mutex> lock(queueMutex);
+        pending.push_back(&mutation);
+        queued.notify_one();
+        applied.wait(lock, [&mutation] { return mutation.done; });
+        selection = mutation.selection;
+        return mutation.reply;
+    }
+
+    string handle(const string& command, SelectionState& selection) {
+        if (command.find("view") == 0 || command.find("pan") == 0 || command.find("zoom") == 0 ||
+            command.find("mode") == 0) {
+            return "Viewport and mode commands are not available in server mode.\n";
         }
-        else if (command == "shapes") {
-            c.shapesAvalible();
+        if (!isQuery(command)) {
+            return mutate(command, selection);
+        }
+        shared_ptr<const Commands> scene = atomic_load(&published);
+        ostringstream reply;
+        consoleOutput = &reply;
+        runQuery(command, *scene, selection);
+        consoleOutput = &cout;
+        return reply.str();
+    }
+
+    // One line in, the command's output plus an empty line out
+    void serveClient(int client) {
+        SelectionState selection = { -1, {} };
+        string buffered;
+        char chunk[4096];
+        ssize_t received;
+        while ((received = recv(client, chunk, sizeof(chunk), 0)) > 0) {
+            buffered.append(chunk, (size_t)received);
+            size_t end;
+            while ((end = buffered.find('\n')) != string::npos) {
+                string command = buffered.substr(0, end);
+                buffered.erase(0, end + 1);
+                if (!command.empty() && command.back() == '\r') {
+                    command.pop_back();
+                }
+                if (command == "exit") {
+                    close(client);
+                    return;
+                }
+                string reply = handle(command, selection) + "\n";
+                for (size_t sent = 0; sent < reply.size();) {
+                    ssize_t n = send(client, reply.data() + sent, reply.size() - sent, 0);
+                    if (n <= 0) {
+                        close(client);
+                        return;
+                    }
+                    sent += (size_t)n;
+                }
+            }
         }
-        else if (command == "list") {
-            c.listShapes();
+        close(client);
+    }
+
+public:
+    explicit SceneServer(OperationLog* log) : journal(log) {}
+
+    int run(const string& path) {
+        if (journal != nullptr) {
+            live.recover(*journal);
         }
-        else if (command == "undo") {
-            c.undo(board);
-            board.print();
+        published = make_shared<Commands>(live.version());
+
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+            cout << "Invalid socket path.\n";
+            return 1;
         }
-        else if (command.find("save") == 0) {
-            c.saveBoard(command);
+        strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(path.c_str());
+        if (listener < 0 || ::bind(listener, (sockaddr*)&address, sizeof(address)) < 0 || listen(listener, 64) < 0) {
+            cout << "Could not listen on " << path << ".\n";
+            return 1;
         }
-        else if (command.find("load") == 0) {
-            c.loadBoard(command, board);
-            board.print();
+        signal(SIGPIPE, SIG_IGN);
+        thread(&SceneServer::writer, this).detach();
+        cout << "Serving scene on " << path << ".\n";
+
+        while (true) {
+            int client = accept(listener, nullptr, nullptr);
+            if (client >= 0) {
+                thread(&SceneServer::serveClient, this, client).detach();
+            }
         }
-        else if (command == "clear") {
-            board.clear();
-            board.print();
+    }
+};
+#endif
+
+int main(int argc, char* argv[]) {
+    bool async = false;
+    bool autosave = true;
+    bool paced = false;
+    long long fuzzCases = 0;
+    unsigned fuzzSeed = 1;
+    string socketPath, recordPath, replayPath;
+    for (int i = 1; i < argc; ++i) {
+        string option = argv[i];
+        if (option == "--async") {
+            async = true;
         }
-        else if (command.find("select") == 0) {
-            c.select(command);
+        else if (option == "--serve" && i + 1 < argc) {
+            socketPath = argv[++i];
         }
-        else if (command.find("move") == 0) {
-            c.moveShape(command, board);
-            board.print();
+        else if (option == "--no-autosave") {
+            autosave = false;
         }
-        else if (command == "remove") {
-            c.removeShape(board);
+        else if (option == "--record" && i + 1 < argc) {
+            recordPath = argv[++i];
         }
-        else if (command.find("edit") == 0) {
-            c.editShape(command, board);
-            board.print();
+        else if (option == "--replay" && i + 1 < argc) {
+            replayPath = argv[++i];
+        }
+        else if (option == "--paced") {
+            paced = true;
+        }
+        else if (option == "--fuzz" && i + 1 < argc) {
+            fuzzCases = atoll(argv[++i]);
+        }
+        else if (option == "--seed" && i + 1 < argc) {
+            fuzzSeed = (unsigned)atoll(argv[++i]);
+        }
+        else if (option == "--canvas" && i + 1 < argc) {
+            if (!setCanvasSize(argv[++i])) {
+                cout << "Invalid canvas size. Use: --canvas <width>x<height>, each side from 1 to " << MAX_CANVAS << ".\n";
+                return 1;
+            }
+        }
+        else {
+            cout << "Unknown option " << option << ". Available options: --async, --serve <socket>, --no-autosave, "
+                "--canvas <width>x<height>, --record <trace>, --replay <trace> [--paced], --fuzz <cases> [--seed <n>]\n";
+            return 1;
+        }
+    }
+
+    if (fuzzCases > 0) {
+        return runFuzz(fuzzCases, fuzzSeed);
+    }
+
+    if (!replayPath.empty()) {
+        return replayTrace(replayPath, paced);
+    }
+
+    // Replays start from an empty scene, so a recorded session has to start
+    // from one too; the autosave stays on disk for the next normal session
+    if (!recordPath.empty() && socketPath.empty() && autosave) {
+        cout << "Recording starts from an empty scene; autosave is off for this session.\n";
+        autosave = false;
+    }
+
+    unique_ptr<OperationLog> journal;
+    if (autosave) {
+        journal.reset(new OperationLog("autosave"));
+    }
+
+    if (!socketPath.empty()) {
+#ifndef _WIN32
+        SceneServer server(journal.get());
+        return server.run(socketPath);
+#else
+        cout << "Server mode needs Unix domain sockets, which this build does not support.\n";
+        return 1;
+#endif
+    }
+
+    Board board;
+    Commands c;
+    string command;
+    if (journal) {
+        c.recover(*journal);
+    }
+    ofstream trace;
+    if (!recordPath.empty()) {
+        trace.open(recordPath);
+        if (!trace.is_open()) {
+            cout << "Could not open trace " << recordPath << " for recording.\n";
+            return 1;
         }
-        else if (command.find("paint") == 0) {
-			c.paint(command, board);
+        trace << "# canvas " << canvasWidth << "x" << canvasHeight << "\n";
+    }
+    auto sessionStart = chrono::steady_clock::now();
+    unique_ptr<AsyncRenderer> renderer;
+    if (async) {
+        renderer.reset(new AsyncRenderer());
+        c.setDeferredRendering(true);
+    }
+
+    // Prints the board, or hands a snapshot of the scene to the render thread
+    auto present = [&](bool blank) {
+        if (renderer) {
+            renderer->publish(blank ? make_shared<Frame>(Frame{ {}, {}, {}, board.view, board.braille }) : c.frame(board));
         }
         else {
-            c.addShape(command, board);
             board.print();
         }
+    };
+
+    while (true) {
+        cout << "Enter a command: ";
+        if (!getline(cin, command)) {
+            break;
+        }
+        if (trace.is_open()) {
+            trace << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - sessionStart).count()
+                << "\t" << command << "\n" << flush;
+        }
+        bool running;
+        {
+            TRACE_SCOPE("command");
+            running = runCommand(command, c, board, present);
+            c.flushLog();
+        }
+        if (!running) {
+            break;
+        }
         cout << "\n";
     }
 